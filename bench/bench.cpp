@@ -0,0 +1,330 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ds/stats.h"
+#include "ds/unit.h"
+#include "lex.h"
+#include "parse.h"
+#include "resolve.h"
+#include "type_infer.h"
+
+using namespace std;
+
+// Generates families of programs that grow with n, times the lexer, the
+// parser and type inference on each, and fits how each phase scales.
+
+string let_chain(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl << "let id = \\x -> x in" << endl;
+  s << "let v0 = id Unit in" << endl;
+  for (size_t i = 1; i < n; i++) {
+    s << "let v" << i << " = id v" << i - 1 << " in" << endl;
+  }
+  s << "v" << n - 1 << endl;
+  return s.str();
+}
+
+string wide_data(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl << "data Wide a {" << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "  C" << i << ":forall a.a->Wide a" << (i + 1 < n ? ";" : "")
+      << endl;
+  }
+  s << "}" << endl << "let get = \\w -> case w of {" << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "  C" << i << " x -> x" << (i + 1 < n ? ";" : "") << endl;
+  }
+  s << "} in" << endl << "get (C0 Unit)" << endl;
+  return s.str();
+}
+
+string deep_lambda(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl << "let f = ";
+  for (size_t i = 0; i < n; i++) {
+    s << "\\x" << i << " -> ";
+  }
+  s << "x0 in" << endl << "f";
+  for (size_t i = 0; i < n; i++) {
+    s << " Unit";
+  }
+  s << endl;
+  return s.str();
+}
+
+// The type of xi has 2^i leaves, which only sharing keeps tractable.
+string pair_doubling(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl
+    << "data Pair a b { Pair:forall a.forall b.a->b->Pair a b }" << endl
+    << "let pair = \\x -> \\y -> Pair x y in" << endl
+    << "let x0 = \\z -> z in" << endl;
+  for (size_t i = 1; i < n; i++) {
+    s << "let x" << i << " = pair x" << i - 1 << " x" << i - 1 << " in"
+      << endl;
+  }
+  s << "Unit" << endl;
+  return s.str();
+}
+
+string rec_group(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl << "rec f0 = \\x -> f1 x" << endl;
+  for (size_t i = 1; i < n; i++) {
+    s << "and f" << i << " = \\x -> f" << (i + 1) % n << " x" << endl;
+  }
+  s << "in Unit" << endl;
+  return s.str();
+}
+
+string rank_n_gadt(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl
+    << "data Int { Zero:Int }" << endl
+    << "data Bool { False:Bool; True:Bool }" << endl
+    << "data Expr a {" << endl
+    << "  I:Int->Expr Int;" << endl
+    << "  B:Bool->Expr Bool;" << endl
+    << "  Add:Expr Int->Expr Int->Expr Int;" << endl
+    << "  If:forall a.Expr Bool->Expr a->Expr a->Expr a" << endl
+    << "}" << endl
+    << "data Id { Id:(forall a.a->a)->Id }" << endl
+    << "let add:Int->Int->Int = \\a -> \\b -> a in" << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "rec eval" << i << ":forall a.Expr a->a = \\x -> case x of:forall "
+      << "a.Expr a->a {" << endl
+      << "  I n -> n;" << endl
+      << "  B b -> b;" << endl
+      << "  Add e1 e2 -> add (eval" << i << " e1) (eval" << i << " e2);" << endl
+      << "  If c e1 e2 -> case eval" << i << " c of {" << endl
+      << "    True -> eval" << i << " e1;" << endl
+      << "    False -> eval" << i << " e2" << endl
+      << "  }" << endl
+      << "} in" << endl
+      << "let app" << i << " = \\f -> case f of { Id g -> g (eval" << i
+      << " (I Zero)) } in" << endl;
+  }
+  s << "Unit" << endl;
+  return s.str();
+}
+
+// A case over every constructor of a GADT, each refining the index its own
+// way, checked against the signature on the case.
+string wide_gadt(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl
+    << "data Int { Zero:Int }" << endl
+    << "data Bool { False:Bool; True:Bool }" << endl
+    << "data Wide a {" << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "  C" << i << ":" << (i % 3 == 0   ? "Int->Wide Int"
+                               : i % 3 == 1 ? "Bool->Wide Bool"
+                                            : "forall a.Wide a->Wide a")
+      << (i + 1 < n ? ";" : "") << endl;
+  }
+  s << "}" << endl
+    << "rec get:forall a.Wide a->a = \\w -> case w of:forall a.Wide a->a {"
+    << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "  C" << i << " x -> " << (i % 3 == 2 ? "get x" : "x")
+      << (i + 1 < n ? ";" : "") << endl;
+  }
+  s << "} in" << endl << "get (C0 Zero)" << endl;
+  return s.str();
+}
+
+// Mostly blanks, comments and long ffi blocks, the bulk of large generated
+// files.
+string trivia(size_t n) {
+  stringstream s;
+  s << "data Unit { Unit:Unit }" << endl;
+  for (size_t i = 0; i < n; i++) {
+    s << "-- binding " << i << ", a line comment that runs for a while" << endl
+      << "{-" << endl;
+    for (size_t j = 0; j < 4; j++) {
+      s << "   a block comment over several lines, as generators write them"
+        << endl;
+    }
+    s << "-}" << endl
+      << "let v" << i << " =" << endl
+      << "        ffi `" << endl;
+    for (size_t j = 0; j < 8; j++) {
+      s << "          BSL_RT_VAR_T x" << j << " = ((int) " << j
+        << ") + ((int) 2) * ((int) 3) + ((int) 4);" << endl;
+    }
+    s << "          x0" << endl << "        ` in" << endl;
+  }
+  s << "Unit" << endl;
+  return s.str();
+}
+
+struct Family {
+  string name;
+  function<string(size_t)> generate;
+  vector<size_t> sizes;
+  // whether the work is expected to double with each step of n, rather than
+  // to grow like a power of n
+  bool doubling;
+};
+
+struct Sample {
+  size_t n, bytes;
+  double lex, parse, infer;
+  Stats stats;
+};
+
+double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start)
+      .count();
+}
+
+Sample run(const string &source, size_t n) {
+  Sample s;
+  s.n = n;
+  s.bytes = source.size();
+  thread_stats = ThreadStats();
+  auto file = add_source("bench.bsl", source);
+  // The parser pulls its tokens from the lexer as it goes, so the lexer is
+  // timed on a pass of its own and the parse includes lexing again.
+  auto start = chrono::steady_clock::now();
+  Lexer tokens(file);
+  while (tokens.next().token_type != TokenType::END) {
+  }
+  s.lex = seconds_since(start);
+  start = chrono::steady_clock::now();
+  Lexer lexer(file);
+  Parser parser(lexer);
+  auto unit = parser.parse();
+  Resolver resolver(unit);
+  s.parse = seconds_since(start);
+  start = chrono::steady_clock::now();
+  TypeInfer type_infer(unit);
+  s.infer = seconds_since(start);
+  s.stats = total_stats();
+  free_types();
+  return s;
+}
+
+// The slope of log y against log n over the samples, fitted by least
+// squares: about 1 for a phase linear in n, 2 for a quadratic one. If
+// doubling, the slope of log2 y against n instead, which is about 1 when y
+// doubles with each step of n.
+double exponent(const vector<Sample> &samples, function<double(Sample)> y,
+                bool doubling) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, k = 0;
+  for (auto &s : samples) {
+    if (y(s) <= 0) {
+      continue;
+    }
+    double lx = doubling ? double(s.n) : log(double(s.n));
+    double ly = doubling ? log2(y(s)) : log(y(s));
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+    k++;
+  }
+  if (k < 2 || k * sxx == sx * sx) {
+    return 0;
+  }
+  return (k * sxy - sx * sy) / (k * sxx - sx * sx);
+}
+
+void usage(const char *cmd) {
+  cerr << "Usage: " << cmd << " [options]" << endl
+       << "Options:" << endl
+       << "  -f $family\t\tRun only $family" << endl
+       << "  -r $repeats\t\tTake the best of $repeats runs (default 3)" << endl
+       << "  -x $exponent\t\tFail if a phase grows faster than n^$exponent"
+       << endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  vector<Family> families = {
+      {"let_chain", let_chain, {250, 500, 1000, 2000, 4000}, false},
+      {"wide_data", wide_data, {250, 500, 1000, 2000, 4000}, false},
+      {"deep_lambda", deep_lambda, {250, 500, 1000, 2000, 4000}, false},
+      {"pair_doubling", pair_doubling, {4, 6, 8, 10, 12, 14}, true},
+      {"rec_group", rec_group, {250, 500, 1000, 2000, 4000}, false},
+      {"rank_n_gadt", rank_n_gadt, {25, 50, 100, 200, 400}, false},
+      {"wide_gadt", wide_gadt, {250, 500, 1000, 2000, 4000}, false},
+      {"trivia", trivia, {625, 1250, 2500, 5000, 10000}, false},
+  };
+  string only;
+  size_t repeats = 3;
+  double max_exponent = 0;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || i + 1 == argc) {
+      usage(argv[0]);
+    }
+    switch (argv[i++][1]) {
+      case 'f':
+        only = argv[i];
+        break;
+      case 'r':
+        if (atoi(argv[i]) < 1) {
+          usage(argv[0]);
+        }
+        repeats = atoi(argv[i]);
+        break;
+      case 'x':
+        max_exponent = atof(argv[i]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  stats_enabled = true;
+  bool failed = false;
+  cout << "family,n,bytes,lex,parse,infer,unify,inst,nodes" << endl;
+  for (auto &f : families) {
+    if (!only.empty() && f.name != only) {
+      continue;
+    }
+    vector<Sample> samples;
+    for (auto n : f.sizes) {
+      auto source = f.generate(n);
+      Sample best = run(source, n);
+      for (size_t r = 1; r < repeats; r++) {
+        auto s = run(source, n);
+        best.lex = min(best.lex, s.lex);
+        best.parse = min(best.parse, s.parse);
+        best.infer = min(best.infer, s.infer);
+      }
+      cout << f.name << "," << n << "," << best.bytes << "," << best.lex << ","
+           << best.parse << "," << best.infer << "," << best.stats.unify << ","
+           << best.stats.inst << "," << best.stats.nodes << endl;
+      samples.push_back(best);
+    }
+    // The counts do not vary from run to run, so the exponent fitted to the
+    // nodes allocated catches a regression that timing noise would hide.
+    auto d = f.doubling;
+    vector<pair<string, double>> exponents = {
+        {"lex", exponent(samples, [](Sample s) { return s.lex; }, d)},
+        {"parse", exponent(samples, [](Sample s) { return s.parse; }, d)},
+        {"infer", exponent(samples, [](Sample s) { return s.infer; }, d)},
+        {"nodes",
+         exponent(samples, [](Sample s) { return double(s.stats.nodes); },
+                  d)},
+    };
+    for (auto &e : exponents) {
+      cout << "# " << f.name << " " << e.first << " ~ "
+           << (d ? "2^(n*" : "n^") << e.second << (d ? ")" : "") << endl;
+      if (!d && max_exponent > 0 && e.second > max_exponent) {
+        cerr << f.name << ": " << e.first << " grows like n^" << e.second
+             << ", faster than n^" << max_exponent << endl;
+        failed = true;
+      }
+    }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,7 +3,7 @@
 
 #include <stdlib.h>
 
-void *BSL_RT_MALLOC(size_t sz) {
+static void *BSL_RT_MALLOC(size_t sz) {
   static void *base = 1 << 23, *top = 1 << 23;
   if ((top -= sz) < base) {
     base = malloc(1 << 23);
@@ -19,7 +19,7 @@ typedef struct {
   BSL_RT_VAR_T env[];
 } * BSL_RT_CLOSURE_T;
 
-BSL_RT_VAR_T BSL_RT_CALL(BSL_RT_CLOSURE_T c, BSL_RT_VAR_T a) {
+static BSL_RT_VAR_T BSL_RT_CALL(BSL_RT_CLOSURE_T c, BSL_RT_VAR_T a) {
   return c->fun(a, c->env);
 }
 
@@ -12,7 +12,7 @@ typedef struct {
   BSL_RT_VAR_T env[];
 } * BSL_RT_CLOSURE_T;
 
-BSL_RT_VAR_T BSL_RT_CALL(BSL_RT_CLOSURE_T c, BSL_RT_VAR_T a) {
+static BSL_RT_VAR_T BSL_RT_CALL(BSL_RT_CLOSURE_T c, BSL_RT_VAR_T a) {
   return c->fun(a, c->env);
 }
 
@@ -1,6 +1,7 @@
 #ifndef SU_BOLEYN_BSL_CODE_GENERATE_H
 #define SU_BOLEYN_BSL_CODE_GENERATE_H
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <limits>
@@ -14,7 +15,6 @@
 
 #include "ds/data.h"
 #include "ds/expr.h"
-#include "ds/ffi.h"
 #include "ds/unit.h"
 #include "optimize.h"
 
@@ -31,11 +31,20 @@ const string BSL_TAG_TYPE_ = "BSL_TAG_TYPE_";
 const string BSL_TAG_ = "BSL_TAG_";
 const string BSL_CON_ = "BSL_CON_";
 const string BSL_FUN_ = "BSL_FUN_";
+const string BSL_CLO_ = "BSL_CLO_";
 const string BSL_BLK_ = "BSL_BLK_";
 const string BSL_VAR_ = "BSL_VAR_";
+const string BSL_EXP_ = "BSL_EXP_";
+const string BSL_INIT_ = "BSL_INIT_";
 const string BSL_ENV = "BSL_ENV";
 
 struct CodeGenerator {
+  // A function that takes arity arguments at once, fns[idx], or no known
+  // function if arity is 0.
+  struct Fun {
+    size_t idx, arity;
+  };
+
   shared_ptr<Unit> unit;
   shared_ptr<Optimizer> optimizer;
 
@@ -43,6 +52,15 @@ struct CodeGenerator {
   vector<shared_ptr<stringstream>> fns;
   set<size_t> cons;
   map<string, size_t> maxarg, to_ptr;
+  // the functions the variables in scope are bound to, and the variables an
+  // ffi block may assign or take the address of, which are never bound to
+  // one, as they may come to hold another closure
+  map<StringView, vector<Fun>> funs;
+  set<StringView> written;
+  // the variables kept in C globals, and the functions whose closures have
+  // an empty environment and are allocated statically
+  set<string> globals;
+  vector<size_t> clos;
 
   CodeGenerator(ostream &out, shared_ptr<Unit> unit,
                 shared_ptr<Optimizer> optimizer)
@@ -50,8 +68,10 @@ struct CodeGenerator {
     codegen_unit(out);
   }
 
-  string var(string v) {
-    string nv = BSL_VAR_;
+  // Spells a name with `_` and `'` as `__` and `_0`, so that `_1` can
+  // separate two names.
+  static string mangle(const string &v) {
+    string nv;
     for (size_t i = 0; i < v.length(); i++) {
       if (v[i] == '_') {
         nv.push_back('_');
@@ -65,6 +85,13 @@ struct CodeGenerator {
     }
     return nv;
   }
+  static string var(const string &v) { return BSL_VAR_ + mangle(v); }
+  // The global that holds the value x exported by module m.
+  static string exported(const string &m, const string &x) {
+    return BSL_EXP_ + mangle(m) + "_1" + mangle(x);
+  }
+  // The function that runs the top-level bindings of module m once.
+  static string init(const string &m) { return BSL_INIT_ + mangle(m); }
   string tmp() { return BSL_VAR_ + "_1"; }
   string type(const string &t) { return BSL_TYPE_ + t; }
   string tag_type(const string &t) { return BSL_TAG_TYPE_ + t; }
@@ -89,12 +116,17 @@ struct CodeGenerator {
     ss << BSL_FUN_ << i;
     return ss.str();
   }
+  string clo(size_t i) {
+    stringstream ss;
+    ss << BSL_CLO_ << i;
+    return ss.str();
+  }
   string blk(size_t i) {
     stringstream ss;
     ss << BSL_BLK_ << i;
     return ss.str();
   }
-  string ffi(const string &f, set<string> &fv) {
+  string ffi(StringView f, set<string> &fv) {
     stringstream s;
     size_t idx = 0;
     while (idx < f.length()) {
@@ -117,7 +149,9 @@ struct CodeGenerator {
               v.push_back(c);
               idx++;
             }
-            fv.insert(v);
+            if (!globals.count(v)) {
+              fv.insert(v);
+            }
             s << var(v);
           } else {
             assert(false);
@@ -131,8 +165,17 @@ struct CodeGenerator {
   }
 
   void codegen_unit(ostream &out) {
-    // TODO handle include here someday
     out << "#include <bsl_rt.h>" << endl;
+    for (auto &i : unit->imports) {
+      out << "void " << init(i.module) << "(void);" << endl;
+      for (auto &v : i.values) {
+        out << "extern " << BSL_RT_VAR_T << " " << exported(i.module, v.first)
+            << ";" << endl;
+      }
+    }
+    for (auto &x : unit->exports) {
+      out << BSL_RT_VAR_T << " " << exported(unit->module, x) << ";" << endl;
+    }
 
     stringstream delcs;
     codegen_data(delcs);
@@ -142,6 +185,10 @@ struct CodeGenerator {
 
     out << delcs.str() << endl;
 
+    for (auto &x : globals) {
+      out << "static " << BSL_RT_VAR_T << " " << var(x) << ";" << endl;
+    }
+
     for (size_t i : cons) {
       out << "static " << BSL_RT_VAR_T << " " << con(i) << "(";
       for (size_t j = 0; j < i; j++) {
@@ -171,6 +218,10 @@ struct CodeGenerator {
       header.back() = ';';
       out << "static " << header << endl;
     }
+    for (auto i : clos) {
+      out << "static " << BSL_RT_FUN_T << " " << clo(i) << "[] = {" << fun(i)
+          << "};" << endl;
+    }
     for (auto fn : fns) {
       out << "static " << fn->str();
     }
@@ -178,8 +229,17 @@ struct CodeGenerator {
       out << "static " << blk->str();
     }
 
-    // TODO handle module here someday
-    out << "int main() { " << main.str() << "; }" << endl;
+    stringstream inits;
+    for (auto &i : unit->imports) {
+      inits << init(i.module) << "(); ";
+    }
+    if (unit->module.empty()) {
+      out << "int main() { " << inits.str() << main.str() << "; }" << endl;
+    } else {
+      out << "void " << init(unit->module) << "(void) { static int done; "
+          << "if (!done) { done = 1; " << inits.str() << main.str() << "; } }"
+          << endl;
+    }
   }
 
   void codegen_data(ostream &out) {
@@ -239,7 +299,7 @@ struct CodeGenerator {
 
         for (size_t i = 0; i < da->constructors.size(); i++) {
           auto c = da->constructors[i];
-          out << BSL_RT_VAR_T << " " << con(c->name) << "(";
+          out << "static " << BSL_RT_VAR_T << " " << con(c->name) << "(";
           for (size_t j = 0; j < c->arg; j++) {
             out << BSL_RT_VAR_T << " " << var(arg(j)) << ", ";
           }
@@ -278,23 +338,57 @@ struct CodeGenerator {
     }
   }
 
+  // The top-level bindings of a module, ending in storing the values it
+  // exports rather than in its own body, which only runs when it is the main
+  // program.
+  Expr *exporting() {
+    auto &arena = unit->arena;
+    stringstream s;
+    s << " (";
+    for (auto &x : unit->exports) {
+      s << exported(unit->module, x) << " = $" << x << ", ";
+    }
+    s << "NULL) ";
+    auto body = arena.make<Ffi>();
+    body->source = arena.copy(s.str());
+    Expr *expr;
+    auto hole = &expr;
+    for (auto e = unit->expr; e->sig == nullptr && (e->T == ExprType::LET ||
+                                                    e->T == ExprType::REC);
+         e = e->T == ExprType::LET ? e->as<Let>()->e2 : e->as<Rec>()->e) {
+      if (e->T == ExprType::LET) {
+        auto l = arena.make<Let>();
+        *l = *e->as<Let>();
+        *hole = l;
+        hole = &l->e2;
+      } else {
+        auto r = arena.make<Rec>();
+        *r = *e->as<Rec>();
+        *hole = r;
+        hole = &r->e;
+      }
+    }
+    *hole = body;
+    return expr;
+  }
+
   void codegen_expr(ostream &out) {
-    auto expr = unit->expr;
+    auto &arena = unit->arena;
+    auto expr = unit->module.empty() ? unit->expr : exporting();
     for (auto dai : unit->data) {
       auto da = dai.second;
       if (da->constructors.size()) {
         for (size_t i = 0; i < da->constructors.size(); i++) {
           auto c = da->constructors[i];
-          auto e = make_shared<Expr>();
-          e->T = ExprType::LET;
-          e->x = c->name;
-          auto lam = make_shared<Expr>();
-          auto cur = lam;
+          auto e = arena.make<Let>();
+          e->x = arena.copy(c->name);
+          Expr *lam;
+          auto hole = &lam;
           for (size_t j = 0; j < c->arg; j++) {
-            cur->T = ExprType::ABS;
-            cur->x = arg(j);
-            cur->e = make_shared<Expr>();
-            cur = cur->e;
+            auto a = arena.make<Abs>();
+            a->x = arena.copy(arg(j));
+            *hole = a;
+            hole = &a->e;
           }
           stringstream s;
           s << " " << con(c->name) << "(";
@@ -320,9 +414,9 @@ struct CodeGenerator {
             }
           }
           s << ") ";
-          cur->T = ExprType::FFI;
-          cur->ffi = make_shared<Ffi>();
-          cur->ffi->source = s.str();
+          auto f = arena.make<Ffi>();
+          f->source = arena.copy(s.str());
+          *hole = f;
           e->e1 = lam;
           e->e2 = expr;
           expr = e;
@@ -330,61 +424,345 @@ struct CodeGenerator {
       }
     }
     if (optimizer != nullptr) {
-      expr = optimizer->optimize(expr);
+      expr = optimizer->optimize(expr, *unit);
+    }
+    // the top-level bindings are statements that store their globals
+    globals = top_level(expr);
+    for (;;) {
+      set<string> fv;
+      if (expr->T == ExprType::LET && globals.count(expr->as<Let>()->x)) {
+        auto l = expr->as<Let>();
+        out << "  " << var(l->x) << " = ";
+        auto f = codegen_bound(out, l->e1, fv);
+        out << ";" << endl;
+        bind(l->x, f);
+        expr = l->e2;
+      } else if (expr->T == ExprType::REC &&
+                 globals.count(expr->as<Rec>()->xes.front().x)) {
+        codegen_rec(out, expr->as<Rec>(), fv, false);
+        expr = expr->as<Rec>()->e;
+      } else {
+        break;
+      }
     }
     set<string> fv;
     codegen_expr_(out, expr, fv);
   }
 
-  void codegen_expr_(ostream &out, shared_ptr<Expr> e, set<string> &fv) {
+  size_t reserve_fn() {
+    fns.push_back(make_shared<stringstream>());
+    return fns.size() - 1;
+  }
+  void bind(StringView x, Fun f) {
+    funs[x].push_back(written.count(x) ? Fun{0, 0} : f);
+  }
+  void unbind(StringView x) {
+    auto it = funs.find(x);
+    it->second.pop_back();
+    if (it->second.empty()) {
+      funs.erase(it);
+    }
+  }
+  // The parameters of a and of the lambdas directly in its body, up to one
+  // that repeats a parameter, and the body of the last of them.
+  static vector<StringView> params(Abs *a, Expr **body) {
+    vector<StringView> xs{a->x};
+    *body = a->e;
+    while ((*body)->T == ExprType::ABS &&
+           std::find(xs.begin(), xs.end(), (*body)->as<Abs>()->x) ==
+               xs.end()) {
+      xs.push_back((*body)->as<Abs>()->x);
+      *body = (*body)->as<Abs>()->e;
+    }
+    return xs;
+  }
+  static size_t arity(Abs *a) {
+    Expr *body;
+    return params(a, &body).size();
+  }
+
+  // Compiles the lambda a, and the lambdas directly in it, to fns[idx], which
+  // takes all of their parameters at once, and writes a closure of them
+  // that takes the parameters one at a time. The closure is stored in into,
+  // or in new memory if into is null, unless it has no free variables and
+  // is a static one. For more than one parameter, the
+  // closure calls a chain of functions that each take one and store it in a
+  // new closure, whose environment begins with the free variables of a, as
+  // the one of fns[idx] does, and then has the parameters taken so far.
+  void codegen_abs(ostream &out, Abs *a, set<string> &fv, size_t idx,
+                   const string *into) {
+    Expr *body;
+    auto xs = params(a, &body);
+    for (auto x : xs) {
+      bind(x, Fun{0, 0});
+    }
+    stringstream nnout;
+    codegen_expr_(nnout, body, fv);
+    for (auto x : xs) {
+      unbind(x);
+      fv.erase(x.str());
+    }
+
+    auto &nout = *fns[idx];
+    nout << BSL_RT_VAR_T << " " << fun(idx) << "(";
+    for (auto x : xs) {
+      nout << BSL_RT_VAR_T << " " << var(x) << ", ";
+    }
+    nout << BSL_RT_VAR_T << " " << BSL_ENV << "[]) {" << endl;
+    size_t fv_cnt = 0;
+    for (auto &f : fv) {
+      nout << "  " << BSL_RT_VAR_T << " " << var(f) << " = " << BSL_ENV << "["
+           << fv_cnt << "];" << endl;
+      fv_cnt++;
+    }
+    nout << "  return " << nnout.str() << ";" << endl << "}" << endl;
+
+    size_t first = idx;
+    if (xs.size() > 1) {
+      vector<size_t> stages;
+      for (size_t i = 0; i < xs.size(); i++) {
+        stages.push_back(reserve_fn());
+      }
+      first = stages.front();
+      for (size_t i = 0; i < xs.size(); i++) {
+        auto &sout = *fns[stages[i]];
+        sout << BSL_RT_VAR_T << " " << fun(stages[i]) << "(" << BSL_RT_VAR_T
+             << " " << var(xs[i]) << ", " << BSL_RT_VAR_T << " " << BSL_ENV
+             << "[]) {" << endl
+             << "  return ";
+        if (i + 1 < xs.size()) {
+          cons.insert(fv_cnt + i + 1);
+          sout << con(fv_cnt + i + 1) << "(";
+          for (size_t j = 0; j < fv_cnt + i; j++) {
+            sout << BSL_ENV << "[" << j << "], ";
+          }
+          sout << var(xs[i]) << ", " << BSL_RT_MALLOC << "(sizeof("
+               << BSL_RT_FUN_T << ") + " << fv_cnt + i + 1 << " * sizeof("
+               << BSL_RT_VAR_T << ")), " << fun(stages[i + 1]) << ")";
+        } else {
+          sout << fun(idx) << "(";
+          for (size_t j = 0; j < i; j++) {
+            sout << BSL_ENV << "[" << fv_cnt + j << "], ";
+          }
+          sout << var(xs[i]) << ", " << BSL_ENV << ")";
+        }
+        sout << ";" << endl << "}" << endl;
+      }
+    }
+
+    // a closure without an environment is the same every time
+    if (fv_cnt == 0) {
+      clos.push_back(first);
+      out << "(" << BSL_RT_VAR_T << ") " << clo(first);
+      return;
+    }
+    cons.insert(fv_cnt);
+    out << con(fv_cnt) << "(";
+    for (auto &f : fv) {
+      out << var(f) << ", ";
+    }
+    if (into != nullptr) {
+      out << *into;
+    } else {
+      out << BSL_RT_MALLOC << "("
+          << "sizeof(" << BSL_RT_FUN_T << ") + " << fv_cnt << " * sizeof("
+          << BSL_RT_VAR_T << "))";
+    }
+    out << ", " << fun(first) << ")";
+  }
+
+  // Compiles what a `let` binds, and returns the function it is, if any.
+  Fun codegen_bound(ostream &out, Expr *e, set<string> &fv) {
+    if (e->T != ExprType::ABS) {
+      codegen_expr_(out, e, fv);
+      return Fun{0, 0};
+    }
+    Fun f{reserve_fn(), arity(e->as<Abs>())};
+    codegen_abs(out, e->as<Abs>(), fv, f.idx, nullptr);
+    return f;
+  }
+  // Writes the statements that store the closures of the rec r in the
+  // variables it binds, declared as locals if local is set, and binds them
+  // to their functions until the caller unbinds them. The closures with an
+  // environment get their memory first, as they may refer to one another.
+  void codegen_rec(ostream &out, Rec *r, set<string> &fv, bool local) {
+    map<string, set<string>> fvs;
+    map<string, stringstream> nnouts;
+    vector<Fun> fs;
+    for (auto &xe : r->xes) {
+      fs.push_back(Fun{reserve_fn(), arity(xe.e->as<Abs>())});
+      bind(xe.x, fs.back());
+    }
+    for (size_t i = 0; i < r->xes.size(); i++) {
+      auto &xe = r->xes[i];
+      auto x = var(xe.x);
+      codegen_abs(nnouts[xe.x], xe.e->as<Abs>(), fvs[xe.x], fs[i].idx, &x);
+      fv.insert(fvs[xe.x].begin(), fvs[xe.x].end());
+    }
+    auto decl = local ? BSL_RT_VAR_T + " " : "";
+    for (auto &xe : r->xes) {
+      if (!fvs[xe.x].empty()) {
+        out << "  " << decl << var(xe.x) << " = " << BSL_RT_MALLOC << "("
+            << "sizeof(" << BSL_RT_FUN_T << ") + " << fvs[xe.x].size()
+            << " * sizeof(" << BSL_RT_VAR_T << "));" << endl;
+      }
+    }
+    for (auto &xe : r->xes) {
+      out << "  " << (fvs[xe.x].empty() ? decl : "") << var(xe.x) << " = "
+          << nnouts[xe.x].str() << ";" << endl;
+    }
+  }
+
+  // The names bound by the `let`s and `rec`s e begins with, up to the first
+  // that is bound again somewhere in e or that an ffi block may assign or
+  // take the address of, which are kept in written. They are kept in C
+  // globals, so that a function that only refers to them and to its
+  // parameters has no environment.
+  set<string> top_level(Expr *e) {
+    map<StringView, size_t> binds;
+    vector<Expr *> stack{e};
+    while (!stack.empty()) {
+      auto e = stack.back();
+      stack.pop_back();
+      switch (e->T) {
+        case ExprType::VAR:
+          break;
+        case ExprType::APP:
+          stack.push_back(e->as<App>()->e1);
+          stack.push_back(e->as<App>()->e2);
+          break;
+        case ExprType::ABS:
+          binds[e->as<Abs>()->x]++;
+          stack.push_back(e->as<Abs>()->e);
+          break;
+        case ExprType::LET:
+          binds[e->as<Let>()->x]++;
+          stack.push_back(e->as<Let>()->e1);
+          stack.push_back(e->as<Let>()->e2);
+          break;
+        case ExprType::REC:
+          for (auto &xe : e->as<Rec>()->xes) {
+            binds[xe.x]++;
+            stack.push_back(xe.e);
+          }
+          stack.push_back(e->as<Rec>()->e);
+          break;
+        case ExprType::CASE:
+          stack.push_back(e->as<Case>()->e);
+          for (auto &pe : e->as<Case>()->pes) {
+            for (auto x : pe.xs) {
+              binds[x]++;
+            }
+            stack.push_back(pe.e);
+          }
+          break;
+        case ExprType::FFI: {
+          auto source = e->as<Ffi>()->source;
+          Optimizer::ffi_vars(source, [&](size_t begin, size_t end) {
+            if (Optimizer::writes(source, begin, end)) {
+              written.insert(source.substr(begin, end - begin));
+            }
+          });
+        } break;
+      }
+    }
+    auto global = [&](StringView x) {
+      return binds[x] == 1 && !written.count(x);
+    };
+    set<string> xs;
+    for (;;) {
+      if (e->T == ExprType::LET && global(e->as<Let>()->x)) {
+        xs.insert(e->as<Let>()->x);
+        e = e->as<Let>()->e2;
+      } else if (e->T == ExprType::REC &&
+                 all_of(e->as<Rec>()->xes.begin(), e->as<Rec>()->xes.end(),
+                        [&](const Binding &xe) { return global(xe.x); })) {
+        for (auto &xe : e->as<Rec>()->xes) {
+          xs.insert(xe.x);
+        }
+        e = e->as<Rec>()->e;
+      } else {
+        return xs;
+      }
+    }
+  }
+  // The branch of the case e for the constructor named c, if it has one.
+  static const Branch *find(Case *e, const string &c) {
+    return e->find(StringView(c.data(), c.size()));
+  }
+
+  void codegen_expr_(ostream &out, Expr *e, set<string> &fv) {
     switch (e->T) {
       case ExprType::VAR: {
-        out << var(e->x);
-        fv.insert(e->x);
+        auto v = e->as<Var>();
+        out << var(v->x);
+        if (!globals.count(v->x)) {
+          fv.insert(v->x);
+        }
       } break;
       case ExprType::APP: {
+        auto a = e->as<App>();
+        // a known function given all of its arguments is called by name,
+        // with the environment of its closure, rather than through the
+        // closure, so that the C compiler sees which function it calls
+        vector<Expr *> args;
+        Expr *f = a;
+        while (f->T == ExprType::APP) {
+          args.push_back(f->as<App>()->e2);
+          f = f->as<App>()->e1;
+        }
+        reverse(args.begin(), args.end());
+        if (f->T == ExprType::VAR) {
+          auto x = f->as<Var>()->x;
+          auto it = funs.find(x);
+          if (it != funs.end() && it->second.back().arity != 0 &&
+              it->second.back().arity <= args.size()) {
+            auto g = it->second.back();
+            for (size_t i = g.arity; i < args.size(); i++) {
+              out << BSL_RT_CALL << "(";
+            }
+            out << fun(g.idx) << "(";
+            for (size_t i = 0; i < args.size(); i++) {
+              if (i == g.arity) {
+                out << ", ((" << BSL_RT_CLOSURE_T << ") " << var(x)
+                    << ")->env), ";
+              }
+              set<string> fv_;
+              codegen_expr_(out, args[i], fv_);
+              fv.insert(fv_.begin(), fv_.end());
+              out << (i + 1 < g.arity ? ", " : i + 1 == g.arity ? "" : ")");
+            }
+            if (g.arity == args.size()) {
+              out << ", ((" << BSL_RT_CLOSURE_T << ") " << var(x) << ")->env)";
+            }
+            if (!globals.count(x)) {
+              fv.insert(x);
+            }
+            break;
+          }
+        }
         set<string> fv_;
         out << BSL_RT_CALL << "(";
-        codegen_expr_(out, e->e1, fv);
+        codegen_expr_(out, a->e1, fv);
         out << ", ";
-        codegen_expr_(out, e->e2, fv_);
+        codegen_expr_(out, a->e2, fv_);
         out << ")";
         fv.insert(fv_.begin(), fv_.end());
       } break;
-      case ExprType::ABS: {
-        stringstream nnout;
-        codegen_expr_(nnout, e->e, fv);
-        fv.erase(e->x);
-
-        size_t fn_idx = fns.size();
-        fns.push_back(make_shared<stringstream>());
-        auto &nout = *fns.back();
-        nout << BSL_RT_VAR_T << " " << fun(fn_idx) << "(" << BSL_RT_VAR_T << " "
-             << var(e->x) << ", " << BSL_RT_VAR_T << " " << BSL_ENV << "[]) {"
-             << endl;
-        size_t fv_cnt = 0;
-        for (auto &f : fv) {
-          nout << "  " << BSL_RT_VAR_T << " " << var(f) << " = " << BSL_ENV
-               << "[" << fv_cnt << "];" << endl;
-          fv_cnt++;
-        }
-        nout << "  return " << nnout.str() << ";" << endl << "}" << endl;
-
-        cons.insert(fv_cnt);
-        out << con(fv_cnt) << "(";
-        for (auto &f : fv) {
-          out << var(f) << ", ";
-        }
-        out << BSL_RT_MALLOC << "("
-            << "sizeof(" << BSL_RT_FUN_T << ") + " << fv_cnt << " * sizeof("
-            << BSL_RT_VAR_T << "))"
-            << ", " << fun(fn_idx) << ")";
-      } break;
+      case ExprType::ABS:
+        codegen_abs(out, e->as<Abs>(), fv, reserve_fn(), nullptr);
+        break;
       case ExprType::LET: {
+        auto l = e->as<Let>();
+        // what l binds comes first, so that l->e2 knows the function in it
         set<string> fv_;
+        stringstream e1out;
+        auto f = codegen_bound(e1out, l->e1, fv_);
         stringstream nnout;
-        codegen_expr_(nnout, e->e2, fv);
-        fv.erase(e->x);
+        bind(l->x, f);
+        codegen_expr_(nnout, l->e2, fv);
+        unbind(l->x);
+        fv.erase(l->x);
 
         size_t blk_idx = blks.size();
         blks.push_back(make_shared<stringstream>());
@@ -393,7 +771,7 @@ struct CodeGenerator {
         for (auto &f : fv) {
           nout << BSL_RT_VAR_T << " " << var(f) << ", ";
         }
-        nout << BSL_RT_VAR_T << " " << var(e->x) << ") {" << endl
+        nout << BSL_RT_VAR_T << " " << var(l->x) << ") {" << endl
              << "  return " << nnout.str() << ";" << endl
              << "}" << endl;
 
@@ -401,49 +779,23 @@ struct CodeGenerator {
         for (auto &f : fv) {
           out << var(f) << ", ";
         }
-        codegen_expr_(out, e->e1, fv_);
-        out << ")";
+        out << e1out.str() << ")";
         fv.insert(fv_.begin(), fv_.end());
       } break;
       case ExprType::REC: {
-        map<string, set<string>> fvs;
-        map<string, stringstream> nnouts;
-        for (auto &xe : e->xes) {
-          auto &nnout = nnouts[xe.first];
-          stringstream nnnout;
-          codegen_expr_(nnnout, xe.second->e, fvs[xe.first]);
-          fvs[xe.first].erase(xe.second->x);
-
-          size_t fn_idx = fns.size();
-          fns.push_back(make_shared<stringstream>());
-          auto &nout = *fns.back();
-          nout << BSL_RT_VAR_T << " " << fun(fn_idx) << "(" << BSL_RT_VAR_T
-               << " " << var(xe.second->x) << ", " << BSL_RT_VAR_T << " "
-               << BSL_ENV << "[]) {" << endl;
-          size_t fv_cnt = 0;
-          for (auto &f : fvs[xe.first]) {
-            nout << "  " << BSL_RT_VAR_T << " " << var(f) << " = " << BSL_ENV
-                 << "[" << fv_cnt << "];" << endl;
-            fv_cnt++;
-          }
-          nout << "  return " << nnnout.str() << ";" << endl << "}" << endl;
-
-          cons.insert(fv_cnt);
-          nnout << con(fv_cnt) << "(";
-          for (auto &f : fvs[xe.first]) {
-            nnout << var(f) << ", ";
-          }
-          nnout << var(xe.first) << ", " << fun(fn_idx) << ")";
-        }
-
+        auto r = e->as<Rec>();
+        set<string> fv_;
+        stringstream bindings;
+        codegen_rec(bindings, r, fv_, true);
         stringstream nnout;
-        codegen_expr_(nnout, e->e, fv);
-
-        for (auto &fv_ : fvs) {
-          fv.insert(fv_.second.begin(), fv_.second.end());
+        codegen_expr_(nnout, r->e, fv);
+        for (auto &xe : r->xes) {
+          unbind(xe.x);
         }
-        for (auto &xe : e->xes) {
-          fv.erase(xe.first);
+
+        fv.insert(fv_.begin(), fv_.end());
+        for (auto &xe : r->xes) {
+          fv.erase(xe.x);
         }
 
         size_t blk_idx = blks.size();
@@ -460,18 +812,9 @@ struct CodeGenerator {
             first = false;
           }
         }
-        nout << ") {" << endl;
-        for (auto &xe : e->xes) {
-          nout << "  " << BSL_RT_VAR_T << " " << var(xe.first) << " = "
-               << BSL_RT_MALLOC << "("
-               << "sizeof(" << BSL_RT_FUN_T << ") + " << fvs[xe.first].size()
-               << " * sizeof(" << BSL_RT_VAR_T << "));" << endl;
-        }
-        for (auto &xe : e->xes) {
-          nout << "  " << var(xe.first) << " = " << nnouts[xe.first].str()
-               << ";" << endl;
-        }
-        nout << "  return " << nnout.str() << ";" << endl << "}" << endl;
+        nout << ") {" << endl
+             << bindings.str() << "  return " << nnout.str() << ";" << endl
+             << "}" << endl;
 
         out << blk(blk_idx) << "(";
         {
@@ -487,16 +830,20 @@ struct CodeGenerator {
         out << ")";
       } break;
       case ExprType::CASE: {
+        auto ca = e->as<Case>();
         set<string> fv_;
-        map<string, set<string>> fvs;
         map<string, stringstream> nouts;
-        for (auto &pe : e->pes) {
-          auto &nout = nouts[pe.first];
-          codegen_expr_(nout, pe.second.second, fvs[pe.first]);
-          for (auto x : pe.second.first) {
-            fvs[pe.first].erase(x);
+        for (auto &pe : ca->pes) {
+          set<string> fvs;
+          for (auto x : pe.xs) {
+            bind(x, Fun{0, 0});
+          }
+          codegen_expr_(nouts[pe.c], pe.e, fvs);
+          for (auto x : pe.xs) {
+            unbind(x);
+            fvs.erase(x);
           }
-          fv.insert(fvs[pe.first].begin(), fvs[pe.first].end());
+          fv.insert(fvs.begin(), fvs.end());
         }
 
         size_t blk_idx = blks.size();
@@ -508,24 +855,23 @@ struct CodeGenerator {
         }
         nout << BSL_RT_VAR_T << " " << tmp() << ") {" << endl;
 
-        assert(e->pes.size());
-        auto da = unit->data[unit->cons[e->pes.begin()->first]->data_name];
+        assert(ca->pes.size());
+        auto da = unit->data[unit->cons[ca->pes.front().c]->data_name];
         if (maxarg[da->name] == 0) {
           nout << "  switch ("
                << "(" << tag_type(da->name) << ") " << tmp() << ") {" << endl;
           bool first = true;
           for (size_t i = 0; i < da->constructors.size(); i++) {
             auto c = da->constructors[i];
-            if (e->pes.count(c->name)) {
-              auto &pes = e->pes.find(c->name)->second;
+            if (auto pes = find(ca, c->name)) {
               if (first) {
                 nout << "    default: {" << endl;
               } else {
                 nout << "    case " << tag(c->name) << ": {" << endl;
               }
               first = false;
-              for (size_t i = 0; i < pes.first.size(); i++) {
-                nout << "      " << BSL_RT_VAR_T << " " << var(pes.first[i])
+              for (size_t i = 0; i < pes->xs.size(); i++) {
+                nout << "      " << BSL_RT_VAR_T << " " << var(pes->xs[i])
                      << " = ((" << type(da->name) << "*)(" << tmp() << "))->"
                      << arg(i) << ";" << endl;
               }
@@ -538,12 +884,11 @@ struct CodeGenerator {
         } else {
           if (to_ptr.count(da->name)) {
             assert(da->constructors.size());
-            if (e->pes.count(da->constructors[to_ptr[da->name]]->name)) {
-              auto &pes =
-                  e->pes.find(da->constructors[to_ptr[da->name]]->name)->second;
+            if (auto pes =
+                    find(ca, da->constructors[to_ptr[da->name]]->name)) {
               nout << "  if (" << tmp() << " == NULL) {" << endl;
-              for (size_t i = 0; i < pes.first.size(); i++) {
-                nout << "    " << BSL_RT_VAR_T << " " << var(pes.first[i])
+              for (size_t i = 0; i < pes->xs.size(); i++) {
+                nout << "    " << BSL_RT_VAR_T << " " << var(pes->xs[i])
                      << " = ((" << type(da->name) << "*)(" << tmp() << "))->"
                      << arg(i) << ";" << endl;
               }
@@ -561,17 +906,16 @@ struct CodeGenerator {
             bool first = true;
             for (size_t i = 0; i < da->constructors.size(); i++) {
               auto c = da->constructors[i];
-              if ((!to_ptr.count(da->name) || i != to_ptr[da->name]) &&
-                  e->pes.count(c->name)) {
-                auto &pes = e->pes.find(c->name)->second;
+              auto pes = find(ca, c->name);
+              if ((!to_ptr.count(da->name) || i != to_ptr[da->name]) && pes) {
                 if (first) {
                   nout << "    default: {" << endl;
                 } else {
                   nout << "    case " << tag(c->name) << ": {" << endl;
                 }
                 first = false;
-                for (size_t i = 0; i < pes.first.size(); i++) {
-                  nout << "      " << BSL_RT_VAR_T << " " << var(pes.first[i])
+                for (size_t i = 0; i < pes->xs.size(); i++) {
+                  nout << "      " << BSL_RT_VAR_T << " " << var(pes->xs[i])
                        << " = ((" << type(da->name) << "*)(" << tmp() << "))->"
                        << arg(i) << ";" << endl;
                 }
@@ -584,15 +928,14 @@ struct CodeGenerator {
           } else {
             for (size_t i = 0; i < da->constructors.size(); i++) {
               auto c = da->constructors[i];
-              if ((!to_ptr.count(da->name) || i != to_ptr[da->name]) &&
-                  e->pes.count(c->name)) {
-                auto &pes = e->pes.find(c->name)->second;
+              auto pes = find(ca, c->name);
+              if ((!to_ptr.count(da->name) || i != to_ptr[da->name]) && pes) {
                 if (c->arg == 1 && da->constructors.size() == 1) {
-                  nout << "  " << BSL_RT_VAR_T << " " << var(pes.first.front())
+                  nout << "  " << BSL_RT_VAR_T << " " << var(pes->xs.front())
                        << " = " << tmp() << ";" << endl;
                 } else {
-                  for (size_t i = 0; i < pes.first.size(); i++) {
-                    nout << "  " << BSL_RT_VAR_T << " " << var(pes.first[i])
+                  for (size_t i = 0; i < pes->xs.size(); i++) {
+                    nout << "  " << BSL_RT_VAR_T << " " << var(pes->xs[i])
                          << " = ((" << type(da->name) << "*)(" << tmp()
                          << "))->" << arg(i) << ";" << endl;
                   }
@@ -609,12 +952,12 @@ struct CodeGenerator {
         for (auto &f : fv) {
           out << var(f) << ", ";
         }
-        codegen_expr_(out, e->e, fv_);
+        codegen_expr_(out, ca->e, fv_);
         fv.insert(fv_.begin(), fv_.end());
         out << ")";
       } break;
       case ExprType::FFI: {
-        out << ffi(e->ffi->source, fv);
+        out << ffi(e->as<Ffi>()->source, fv);
       } break;
     }
   }
@@ -1,6 +1,7 @@
 #ifndef SU_BOLEYN_BSL_COMPILER_H
 #define SU_BOLEYN_BSL_COMPILER_H
 
+#include <chrono>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -12,8 +13,10 @@
 #include "code_generate.h"
 #include "ds/unit.h"
 #include "lex.h"
+#include "module.h"
 #include "optimize.h"
 #include "parse.h"
+#include "resolve.h"
 #include "type_infer.h"
 
 using namespace std;
@@ -24,9 +27,19 @@ struct Compiler {
     cerr << "Usage: " << cmd << " [options] file..." << endl
          << "Options:" << endl
          << "  -c\t\t\tCompile to C only" << endl
-         << "  -i $include_path\tAdd an include path" << endl
+         << "  -i $include_path\tAdd an include path for C headers and modules"
+         << endl
          << "  -m $options\t\tPass more options to gcc" << endl
-         << "  -e $executable\tCompile to an executable" << endl;
+         << "  -e $executable\tCompile to an executable" << endl
+         << "  -j $threads\t\tInfer top-level bindings on $threads threads"
+         << endl
+         << "  -t $cache_dir\t\tReuse inferred types cached in $cache_dir"
+         << endl
+         << "  -s $stats_file\tWrite type inference statistics as JSON, with the"
+         << endl
+         << "\t\t\ttime of each top-level binding if -j, -t or a module"
+         << endl
+         << "\t\t\tgroups them" << endl;
     exit(EXIT_FAILURE);
   }
   Compiler(int argc, char** argv) : cmd(argv[0]) {
@@ -34,6 +47,9 @@ struct Compiler {
     bool c_only = false;
     vector<string> include_path;
     string more;
+    size_t threads = 1;
+    string cache_dir;
+    string stats_file;
     for (int i = 1; i < argc; i++) {
       if (argv[i][0] == '-') {
         switch (argv[i][1]) {
@@ -64,6 +80,27 @@ struct Compiler {
             }
             executable = argv[i];
             break;
+          case 'j':
+            i++;
+            if (!(i < argc) || atoi(argv[i]) < 1) {
+              usage();
+            }
+            threads = atoi(argv[i]);
+            break;
+          case 't':
+            i++;
+            if (!(i < argc) || !cache_dir.empty()) {
+              usage();
+            }
+            cache_dir = argv[i];
+            break;
+          case 's':
+            i++;
+            if (!(i < argc) || !stats_file.empty()) {
+              usage();
+            }
+            stats_file = argv[i];
+            break;
           default:
             usage();
         }
@@ -78,12 +115,30 @@ struct Compiler {
       usage();
     }
 
-    ifstream src(source);
-    Lexer lexer(source, src);
+    unique_ptr<TypeCache> cache;
+    if (!cache_dir.empty()) {
+      cache.reset(new TypeCache(cache_dir));
+    }
+    Modules modules(include_path, more, c_only, threads, cache.get());
+
+    Lexer lexer(source);
     Parser parser(lexer);
-    auto unit = parser.parse();
+    auto unit = parser.parse_imports();
+    modules.import(unit, Modules::directory_of(source));
+    parser.parse();
+    modules.bind(unit);
+    Resolver resolver(unit);
 
-    TypeInfer type_infer(unit);
+    stats_enabled = !stats_file.empty();
+    auto start = chrono::steady_clock::now();
+    TypeInfer type_infer(unit, threads, cache.get());
+    if (stats_enabled) {
+      ofstream stats(stats_file);
+      type_infer.write_stats(
+          stats, chrono::duration<double>(chrono::steady_clock::now() - start)
+                     .count());
+    }
+    free_types();
 
     ofstream csrc(source + ".c");
     CodeGenerator code_generator(csrc, unit, make_shared<Optimizer>());
@@ -91,6 +146,9 @@ struct Compiler {
     if (!c_only) {
       stringstream gcc_cmd;
       gcc_cmd << "gcc " << source << ".c";
+      for (auto& m : modules.order) {
+        gcc_cmd << " " << modules.built[m].path << ".o";
+      }
       for (auto& ip : include_path) {
         gcc_cmd << " -I" << ip;
       }
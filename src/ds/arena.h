@@ -0,0 +1,101 @@
+#ifndef SU_BOLEYN_BSL_DS_ARENA_H
+#define SU_BOLEYN_BSL_DS_ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std;
+
+// Nodes are stored in fixed-size blocks so that a node never moves once it is
+// allocated, and are addressed by a 32-bit index. Index 0 is the null node.
+// Each thread allocates from a block of its own; taking a new block is the
+// only step that locks.
+template <typename T>
+struct Arena {
+  static const size_t BLOCK_BITS = 12;
+  static const size_t BLOCK_SIZE = size_t(1) << BLOCK_BITS;
+  static const size_t MAX_BLOCKS = size_t(1) << (32 - BLOCK_BITS);
+  struct Cursor {
+    uint32_t generation, next, end;
+  };
+  static unique_ptr<T[]> blocks[MAX_BLOCKS];
+  static uint32_t used, generation;
+  static mutex lock;
+  static thread_local Cursor cursor;
+  static uint32_t make() {
+    if (cursor.generation != generation || cursor.next == cursor.end) {
+      lock_guard<mutex> guard(lock);
+      assert(used < MAX_BLOCKS);
+      blocks[used].reset(new T[BLOCK_SIZE]());
+      cursor.generation = generation;
+      cursor.next = used << BLOCK_BITS;
+      cursor.end = cursor.next + BLOCK_SIZE;
+      used++;
+      if (cursor.next == 0) {
+        cursor.next = 1;
+      }
+    }
+    return cursor.next++;
+  }
+  static T &at(uint32_t id) {
+    assert(0 < id);
+    return blocks[id >> BLOCK_BITS][id & (BLOCK_SIZE - 1)];
+  }
+  // Must not run while another thread allocates.
+  static void clear() {
+    for (uint32_t i = 0; i < used; i++) {
+      blocks[i].reset();
+    }
+    used = 0;
+    generation++;
+  }
+};
+
+template <typename T>
+unique_ptr<T[]> Arena<T>::blocks[Arena<T>::MAX_BLOCKS];
+template <typename T>
+uint32_t Arena<T>::used = 0;
+template <typename T>
+uint32_t Arena<T>::generation = 1;
+template <typename T>
+mutex Arena<T>::lock;
+template <typename T>
+thread_local typename Arena<T>::Cursor Arena<T>::cursor;
+
+template <typename T>
+struct Ref {
+  uint32_t id;
+  Ref() : id(0) {}
+  Ref(nullptr_t) : id(0) {}
+  static Ref make() {
+    if (stats_enabled) {
+      thread_stats.nodes++;
+    }
+    Ref r;
+    r.id = Arena<T>::make();
+    return r;
+  }
+  T *operator->() const { return &Arena<T>::at(id); }
+  T &operator*() const { return Arena<T>::at(id); }
+  bool operator==(const Ref &r) const { return id == r.id; }
+  bool operator!=(const Ref &r) const { return id != r.id; }
+  bool operator<(const Ref &r) const { return id < r.id; }
+  bool operator==(nullptr_t) const { return id == 0; }
+  bool operator!=(nullptr_t) const { return id != 0; }
+  void swap(Ref &r) { std::swap(id, r.id); }
+};
+
+template <typename T>
+ostream &operator<<(ostream &out, const Ref<T> &r) {
+  return out << r.id;
+}
+
+#endif
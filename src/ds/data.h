@@ -12,12 +12,15 @@ using namespace std;
 struct Constructor {
   string name;
   size_t arg;
-  shared_ptr<Poly> sig;
+  Ref<Poly> sig;
   string data_name;
+  uint32_t slot;
 };
 
 struct Data {
   string name;
+  // the module that declares it, or empty if the unit itself does
+  string module;
   size_t arg;
   vector<shared_ptr<Constructor>> constructors;
 };
@@ -1,108 +1,266 @@
 #ifndef SU_BOLEYN_BSL_DS_EXPR_H
 #define SU_BOLEYN_BSL_DS_EXPR_H
 
-#include <map>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
-#include <set>
+#include <new>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#include "ffi.h"
 #include "position.h"
+#include "string_view.h"
 #include "type.h"
 
 using namespace std;
 
-enum class ExprType { VAR, APP, ABS, LET, REC, CASE, FFI };
+enum class ExprType : uint8_t { VAR, APP, ABS, LET, REC, CASE, FFI };
 
+// The slot of a variable that is not bound anywhere.
+const uint32_t NO_SLOT = UINT32_MAX;
+
+// n elements that live in an ExprArena.
+template <typename T>
+struct Array {
+  T *ptr;
+  uint32_t n;
+  Array() : ptr(nullptr), n(0) {}
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  T &operator[](size_t i) const { return ptr[i]; }
+  T *begin() const { return ptr; }
+  T *end() const { return ptr + n; }
+  T &front() const { return ptr[0]; }
+};
+
+// Every binder has a slot of its own, given by Resolver. The binders of a
+// rec, and the variables of a branch, take consecutive slots from slot on.
 struct Expr {
   ExprType T;
-  string x;
-  shared_ptr<Expr> e1, e2, e;
-  map<string, shared_ptr<Expr>> xes;
-  map<string, pair<vector<string>, shared_ptr<Expr>>> pes;
-  shared_ptr<Ffi> ffi;
-  shared_ptr<Poly> sig, gadt;
+  Ref<Poly> sig;
+  template <typename E>
+  E *as() {
+    assert(T == E::TYPE);
+    return static_cast<E *>(this);
+  }
+};
+
+struct Var : Expr {
+  static const ExprType TYPE = ExprType::VAR;
+  StringView x;
+  // the slot of the binder it refers to
+  uint32_t slot = NO_SLOT;
+};
+
+struct App : Expr {
+  static const ExprType TYPE = ExprType::APP;
+  Expr *e1, *e2;
+};
+
+struct Abs : Expr {
+  static const ExprType TYPE = ExprType::ABS;
   Position pos;
+  uint32_t slot = NO_SLOT;
+  StringView x;
+  Expr *e;
 };
 
-string to_string(shared_ptr<Expr> e, size_t indent = 0,
-                 const string &indents = "") {
+struct Let : Expr {
+  static const ExprType TYPE = ExprType::LET;
+  Position pos;
+  uint32_t slot = NO_SLOT;
+  StringView x;
+  Expr *e1, *e2;
+};
+
+struct Binding {
+  StringView x;
+  Expr *e;
+};
+
+// The bindings are sorted by name.
+struct Rec : Expr {
+  static const ExprType TYPE = ExprType::REC;
+  Position pos;
+  uint32_t slot = NO_SLOT;
+  Array<Binding> xes;
+  Expr *e;
+  const Binding *find(StringView x) const {
+    auto it = lower_bound(
+        xes.begin(), xes.end(), x,
+        [](const Binding &xe, StringView x) { return xe.x < x; });
+    return it != xes.end() && it->x == x ? it : nullptr;
+  }
+};
+
+struct Branch {
+  StringView c;
+  uint32_t slot;
+  Array<StringView> xs;
+  Expr *e;
+};
+
+// The branches are sorted by constructor.
+struct Case : Expr {
+  static const ExprType TYPE = ExprType::CASE;
+  Ref<Poly> gadt;
+  Expr *e;
+  Array<Branch> pes;
+  const Branch *find(StringView c) const {
+    auto it = lower_bound(
+        pes.begin(), pes.end(), c,
+        [](const Branch &pes, StringView c) { return pes.c < c; });
+    return it != pes.end() && it->c == c ? it : nullptr;
+  }
+};
+
+struct Ffi : Expr {
+  static const ExprType TYPE = ExprType::FFI;
+  StringView source;
+  // the variables written as $x in source, in order, and their slots
+  Array<StringView> vars;
+  Array<uint32_t> slots;
+};
+
+// The nodes of a unit, allocated one after another from large blocks and
+// freed all at once with it. A node is only as large as its kind needs, and
+// holds names as views into the sources or into the arena itself, so none
+// needs a destructor.
+struct ExprArena {
+  static const size_t BLOCK_SIZE = size_t(1) << 16;
+  vector<unique_ptr<char[]>> blocks;
+  char *next = nullptr, *end = nullptr;
+  // the bytes handed out, for measuring
+  size_t bytes = 0;
+  void *allocate(size_t size, size_t align) {
+    auto p = reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(next) + align - 1) & ~(align - 1));
+    if (next == nullptr || p + size > end) {
+      auto n = max(size_t(BLOCK_SIZE), size + align);
+      blocks.push_back(unique_ptr<char[]>(new char[n]));
+      next = blocks.back().get();
+      end = next + n;
+      p = reinterpret_cast<char *>(
+          (reinterpret_cast<uintptr_t>(next) + align - 1) & ~(align - 1));
+    }
+    next = p + size;
+    bytes += size;
+    return p;
+  }
+  template <typename E>
+  E *make() {
+    static_assert(is_trivially_destructible<E>::value,
+                  "nodes are never destroyed");
+    auto e = new (allocate(sizeof(E), alignof(E))) E();
+    e->T = E::TYPE;
+    return e;
+  }
+  template <typename T>
+  Array<T> array(const vector<T> &v) {
+    static_assert(is_trivially_destructible<T>::value,
+                  "nodes are never destroyed");
+    Array<T> a;
+    a.n = v.size();
+    if (a.n != 0) {
+      a.ptr = static_cast<T *>(allocate(sizeof(T) * a.n, alignof(T)));
+      uninitialized_copy(v.begin(), v.end(), a.ptr);
+    }
+    return a;
+  }
+  StringView copy(StringView s) {
+    auto p = static_cast<char *>(allocate(s.size(), 1));
+    memcpy(p, s.data(), s.size());
+    return StringView(p, s.size());
+  }
+  StringView copy(const string &s) {
+    return copy(StringView(s.data(), s.size()));
+  }
+};
+
+string to_string(Expr *e, size_t indent = 0, const string &indents = "") {
   stringstream s;
   switch (e->T) {
     case ExprType::VAR:
-      s << e->x;
+      s << e->as<Var>()->x;
       break;
-    case ExprType::APP:
-      s << to_string(e->e1, indent, indents) << " ("
-        << to_string(e->e2, indent, indents) << ")";
-      break;
-    case ExprType::ABS:
-      s << "(\\" << e->x << "->" << endl;
+    case ExprType::APP: {
+      auto a = e->as<App>();
+      s << to_string(a->e1, indent, indents) << " ("
+        << to_string(a->e2, indent, indents) << ")";
+    } break;
+    case ExprType::ABS: {
+      auto a = e->as<Abs>();
+      s << "(\\" << a->x << "->" << endl;
       for (size_t i = 0; i < indent + 1; i++) {
         s << indents;
       }
-      s << to_string(e->e, indent + 1, indents) << ")";
-      break;
-    case ExprType::LET:
+      s << to_string(a->e, indent + 1, indents) << ")";
+    } break;
+    case ExprType::LET: {
+      auto l = e->as<Let>();
       s << "(" << endl;
       for (size_t i = 0; i < indent + 1; i++) {
         s << indents;
       }
-      s << "let " << e->x;
-      if (e->e1->sig != nullptr) {
-        s << ":" << to_string(e->e1->sig);
+      s << "let " << l->x;
+      if (l->e1->sig != nullptr) {
+        s << ":" << to_string(l->e1->sig);
       }
-      s << " = " << to_string(e->e1, indent + 1, indents) << endl;
+      s << " = " << to_string(l->e1, indent + 1, indents) << endl;
       for (size_t i = 0; i < indent + 1; i++) {
         s << indents;
       }
-      s << "in " << to_string(e->e2, indent + 1, indents) << ")";
-      break;
+      s << "in " << to_string(l->e2, indent + 1, indents) << ")";
+    } break;
     case ExprType::REC: {
+      auto r = e->as<Rec>();
       s << "(" << endl;
       for (size_t i = 0; i < indent + 1; i++) {
         s << indents;
       }
       s << "rec ";
       bool first = true;
-      for (auto &xe : e->xes) {
+      for (auto &xe : r->xes) {
         if (!first) {
           for (size_t i = 0; i < indent + 1; i++) {
             s << indents;
           }
           s << "and ";
         }
-        s << xe.first;
-        if (xe.second->sig != nullptr) {
-          s << ":" << to_string(xe.second->sig);
+        s << xe.x;
+        if (xe.e->sig != nullptr) {
+          s << ":" << to_string(xe.e->sig);
         }
-        s << " = " << to_string(xe.second, indent + 1, indents) << endl;
+        s << " = " << to_string(xe.e, indent + 1, indents) << endl;
         first = false;
       }
       for (size_t i = 0; i < indent + 1; i++) {
         s << indents;
       }
-      s << "in " << to_string(e->e, indent + 1, indents) << ")";
+      s << "in " << to_string(r->e, indent + 1, indents) << ")";
     } break;
     case ExprType::CASE: {
-      s << "case " << to_string(e->e, indent, indents) << " of";
-      if (e->gadt != nullptr) {
-        s << ":" << to_string(e->gadt);
+      auto c = e->as<Case>();
+      s << "case " << to_string(c->e, indent, indents) << " of";
+      if (c->gadt != nullptr) {
+        s << ":" << to_string(c->gadt);
       }
       s << " {" << endl;
-      for (auto &pes_ : e->pes) {
-        auto pes = pes_.second;
+      for (auto &pes : c->pes) {
         for (size_t i = 0; i < indent + 1; i++) {
           s << indents;
         }
-        s << pes_.first;
-        for (size_t j = 0; j < pes.first.size(); j++) {
-          s << " " << pes.first[j];
+        s << pes.c;
+        for (auto &x : pes.xs) {
+          s << " " << x;
         }
-        s << "->" << to_string(pes.second, indent + 1, indents) << ";" << endl;
+        s << "->" << to_string(pes.e, indent + 1, indents) << ";" << endl;
       }
       for (size_t i = 0; i < indent; i++) {
         s << indents;
@@ -110,7 +268,7 @@ string to_string(shared_ptr<Expr> e, size_t indent = 0,
       s << "}";
     } break;
     case ExprType::FFI:
-      s << "ffi `" << e->ffi->source << "`";
+      s << "ffi `" << e->as<Ffi>()->source << "`";
       break;
   }
   return s.str();
@@ -1,13 +0,0 @@
-#ifndef SU_BOLEYN_BSL_DS_FFI_H
-#define SU_BOLEYN_BSL_DS_FFI_H
-
-#include <string>
-#include <vector>
-
-using namespace std;
-
-struct Ffi {
-  string source;
-};
-
-#endif
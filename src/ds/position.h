@@ -1,20 +1,39 @@
 #ifndef SU_BOLEYN_BSL_DS_POSITION_H
 #define SU_BOLEYN_BSL_DS_POSITION_H
 
+#include <cstdint>
 #include <iostream>
+#include <sstream>
 #include <string>
 
+#include "source.h"
+
 using namespace std;
 
+// A span of a source, as the offsets of its first byte and of the byte after
+// its last one. Lines and columns are only worked out when a position is
+// printed.
 struct Position {
-  string filename;
-  size_t beginRow, beginColumn, endRow, endColumn;
+  uint32_t file;
+  uint32_t begin, end;
 };
 
+const string &filename_of(const Position &p) { return source(p.file).filename; }
+
+size_t line_of(const Position &p) {
+  return line_column(source(p.file), p.begin).first;
+}
+
+size_t column_of(const Position &p) {
+  return line_column(source(p.file), p.begin).second;
+}
+
 string to_string(const Position &p) {
+  auto &s = source(p.file);
+  auto b = line_column(s, p.begin), e = line_column(s, p.end);
   stringstream out;
-  out << p.filename << ":[" << p.beginRow << "," << p.beginColumn << "-"
-      << p.endRow << "," << p.endColumn << ")";
+  out << s.filename << ":[" << b.first << "," << b.second << "-" << e.first
+      << "," << e.second << ")";
   return out.str();
 }
 
@@ -0,0 +1,64 @@
+#ifndef SU_BOLEYN_BSL_DS_SMALL_VECTOR_H
+#define SU_BOLEYN_BSL_DS_SMALL_VECTOR_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// A vector of trivially copyable elements that keeps its first N elements
+// inline, so that type nodes with few arguments need no heap allocation.
+template <typename T, size_t N>
+struct SmallVector {
+  uint32_t n, cap;
+  T *heap;
+  T local[N];
+  SmallVector() : n(0), cap(N), heap(nullptr) {}
+  SmallVector(const SmallVector &v) : n(0), cap(N), heap(nullptr) {
+    for (size_t i = 0; i < v.size(); i++) {
+      push_back(v[i]);
+    }
+  }
+  SmallVector &operator=(const SmallVector &v) {
+    if (this != &v) {
+      n = 0;
+      for (size_t i = 0; i < v.size(); i++) {
+        push_back(v[i]);
+      }
+    }
+    return *this;
+  }
+  ~SmallVector() { delete[] heap; }
+  T *data() { return heap != nullptr ? heap : local; }
+  const T *data() const { return heap != nullptr ? heap : local; }
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  T &operator[](size_t i) {
+    assert(i < n);
+    return data()[i];
+  }
+  const T &operator[](size_t i) const {
+    assert(i < n);
+    return data()[i];
+  }
+  T *begin() { return data(); }
+  T *end() { return data() + n; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + n; }
+  void push_back(const T &x) {
+    T v = x;
+    if (n == cap) {
+      T *h = new T[2 * cap];
+      for (size_t i = 0; i < n; i++) {
+        h[i] = data()[i];
+      }
+      delete[] heap;
+      heap = h;
+      cap *= 2;
+    }
+    data()[n++] = v;
+  }
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef SU_BOLEYN_BSL_DS_SOURCE_H
+#define SU_BOLEYN_BSL_DS_SOURCE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// A source file, mapped into memory for as long as the compiler runs so that
+// tokens can point into it. A file that cannot be mapped, such as a pipe, is
+// read into text instead. Positions refer to a source by its index in
+// sources(), and to its bytes by 32-bit offsets.
+struct Source {
+  string filename;
+  const char *data;
+  size_t size;
+  string text;
+  // the offset of each line, made when a position in the source is first
+  // printed
+  mutable vector<uint32_t> lines;
+  mutable once_flag lines_made;
+};
+
+vector<unique_ptr<Source>> &sources() {
+  static vector<unique_ptr<Source>> s;
+  return s;
+}
+
+const Source &source(uint32_t file) { return *sources()[file]; }
+
+uint32_t add_source(unique_ptr<Source> s) {
+  if (s->size > UINT32_MAX) {
+    cerr << "lexer: `" << s->filename << "` is too large" << endl;
+    exit(EXIT_FAILURE);
+  }
+  sources().push_back(move(s));
+  return sources().size() - 1;
+}
+
+// Adds a source that is already in memory, such as a generated program.
+uint32_t add_source(const string &filename, const string &text) {
+  unique_ptr<Source> s(new Source());
+  s->filename = filename;
+  s->text = text;
+  s->data = s->text.data();
+  s->size = s->text.size();
+  return add_source(move(s));
+}
+
+uint32_t open_source(const string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "lexer: cannot open `" << filename << "`" << endl;
+    exit(EXIT_FAILURE);
+  }
+  unique_ptr<Source> s(new Source());
+  s->filename = filename;
+  s->data = nullptr;
+  s->size = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      s->data = static_cast<const char *>(p);
+      s->size = st.st_size;
+    }
+  }
+  if (s->data == nullptr) {
+    char buffer[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+      s->text.append(buffer, n);
+    }
+    if (n < 0) {
+      cerr << "lexer: cannot read `" << filename << "`" << endl;
+      exit(EXIT_FAILURE);
+    }
+    s->data = s->text.data();
+    s->size = s->text.size();
+  }
+  close(fd);
+  return add_source(move(s));
+}
+
+// The line and column, both from 1, of the byte at offset in s. A line ends
+// at "\n", "\r\n" or "\r", and a column counts bytes.
+pair<size_t, size_t> line_column(const Source &s, uint32_t offset) {
+  call_once(s.lines_made, [&]() {
+    s.lines.push_back(0);
+    for (size_t i = 0; i < s.size; i++) {
+      if (s.data[i] == '\n' ||
+          (s.data[i] == '\r' && (i + 1 == s.size || s.data[i + 1] != '\n'))) {
+        s.lines.push_back(i + 1);
+      }
+    }
+  });
+  auto line = upper_bound(s.lines.begin(), s.lines.end(), offset) - 1;
+  return make_pair(line - s.lines.begin() + 1, offset - *line + 1);
+}
+
+#endif
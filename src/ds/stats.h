@@ -0,0 +1,75 @@
+#ifndef SU_BOLEYN_BSL_DS_STATS_H
+#define SU_BOLEYN_BSL_DS_STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+// Counts of the work type inference does. Nothing is counted unless
+// stats_enabled is set, so that each counter costs one predictable branch.
+struct Stats {
+  uint64_t unify = 0, inst = 0, gen = 0, ftv = 0, occ = 0, nodes = 0,
+           max_chain = 0;
+  void add(const Stats &s) {
+    unify += s.unify;
+    inst += s.inst;
+    gen += s.gen;
+    ftv += s.ftv;
+    occ += s.occ;
+    nodes += s.nodes;
+    max_chain = max_chain > s.max_chain ? max_chain : s.max_chain;
+  }
+};
+
+bool stats_enabled = false;
+
+// The counts of the threads that have ended.
+Stats &stats_ended() {
+  static Stats s;
+  return s;
+}
+
+mutex &stats_lock() {
+  static mutex m;
+  return m;
+}
+
+// Each thread counts into a table of its own, which is added to the counts of
+// the ended threads when the thread ends, so that counting never locks.
+struct ThreadStats : Stats {
+  ~ThreadStats() {
+    lock_guard<mutex> guard(stats_lock());
+    stats_ended().add(*this);
+  }
+};
+
+thread_local ThreadStats thread_stats;
+
+// The counts of the calling thread and of the threads that have ended.
+Stats total_stats() {
+  lock_guard<mutex> guard(stats_lock());
+  Stats s = stats_ended();
+  s.add(thread_stats);
+  return s;
+}
+
+string json_string(const string &s) {
+  stringstream out;
+  out << '"';
+  for (auto c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      out << "\\u00" << hex << (c >> 4) << (c & 15) << dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SU_BOLEYN_BSL_DS_STRING_VIEW_H
+#define SU_BOLEYN_BSL_DS_STRING_VIEW_H
+
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// A view of size bytes that start at data and belong to someone else, most
+// often a mapped source file. The build is C++11, which has no
+// std::string_view.
+struct StringView {
+  static const size_t npos = size_t(-1);
+  const char *ptr;
+  size_t len;
+  StringView() : ptr(""), len(0) {}
+  StringView(const char *ptr, size_t len) : ptr(ptr), len(len) {}
+  explicit StringView(const char *s) : ptr(s), len(strlen(s)) {}
+  const char *data() const { return ptr; }
+  size_t size() const { return len; }
+  size_t length() const { return len; }
+  bool empty() const { return len == 0; }
+  char operator[](size_t i) const { return ptr[i]; }
+  const char *begin() const { return ptr; }
+  const char *end() const { return ptr + len; }
+  StringView substr(size_t pos, size_t n = npos) const {
+    if (pos > len) {
+      pos = len;
+    }
+    return StringView(ptr + pos, n < len - pos ? n : len - pos);
+  }
+  size_t find(StringView s, size_t pos = 0) const {
+    for (; pos + s.len <= len; pos++) {
+      if (memcmp(ptr + pos, s.ptr, s.len) == 0) {
+        return pos;
+      }
+    }
+    return npos;
+  }
+  bool operator==(StringView s) const {
+    return len == s.len && memcmp(ptr, s.ptr, len) == 0;
+  }
+  bool operator!=(StringView s) const { return !(*this == s); }
+  bool operator==(const char *s) const { return *this == StringView(s); }
+  bool operator!=(const char *s) const { return !(*this == s); }
+  // The order of std::string, so that views sort as their strings do.
+  bool operator<(StringView s) const {
+    int c = memcmp(ptr, s.ptr, len < s.len ? len : s.len);
+    return c < 0 || (c == 0 && len < s.len);
+  }
+  string str() const { return string(ptr, len); }
+  // For the tables that key names by string.
+  operator string() const { return str(); }
+};
+
+ostream &operator<<(ostream &out, StringView s) {
+  return out.write(s.data(), s.size());
+}
+
+#endif
@@ -1,79 +1,157 @@
 #ifndef SU_BOLEYN_BSL_DS_TYPE_H
 #define SU_BOLEYN_BSL_DS_TYPE_H
 
+#include <atomic>
 #include <cassert>
 #include <map>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "arena.h"
+#include "small_vector.h"
+
 using namespace std;
 
 struct Kind {
-  shared_ptr<Kind> par;
+  Ref<Kind> par;
+  uint8_t rank;
   bool is_const;
   bool is_arrow;
   string k;
-  shared_ptr<Kind> left, right;
+  Ref<Kind> left, right;
 };
 
 struct Poly;
 
 struct Mono {
-  shared_ptr<Mono> par;
-  shared_ptr<Kind> kind;
+  Ref<Mono> par;
+  Ref<Kind> kind;
   bool is_const;
   bool is_poly;
-  shared_ptr<Poly> sigma;
+  bool is_forall;
+  bool is_ground;
+  bool no_bound;
+  uint8_t rank;
+  uint32_t level;
+  uint32_t visit;
+  Ref<Mono> copy;
+  Ref<Poly> sigma;
   struct {
     bool is_const;
-    string D;
-    shared_ptr<Mono> d;
+    Ref<Mono> d;
+    uint32_t D;
   } D;
-  vector<shared_ptr<Mono>> tau;
-  bool is_forall;
+  SmallVector<Ref<Mono>, 2> tau;
 };
 
+struct Template;
+
 struct Poly {
   bool is_mono;
-  shared_ptr<Mono> tau;
-  shared_ptr<Mono> alpha;
-  shared_ptr<Poly> sigma;
+  Ref<Mono> tau;
+  Ref<Mono> alpha;
+  Ref<Poly> sigma;
+  Ref<Template> tpl;
 };
 
-bool is_c(shared_ptr<Mono> x) { return x->is_const; }
-bool is_cd(shared_ptr<Mono> x) {
-  return x->is_const && !x->is_poly && x->D.is_const;
-}
-bool is_p(shared_ptr<Mono> x) { return x->is_const && x->is_poly; }
-bool is_f(shared_ptr<Mono> x) { return (!x->is_const) && x->is_forall; }
-bool is_e(shared_ptr<Mono> x) { return (!x->is_const) && (!x->is_forall); }
-bool is_fun(shared_ptr<Mono> x) {
-  return x->is_const && !x->is_poly && is_cd(x) && x->D.D == "->";
+enum class InstOpType { HOLE, LOAD, SHARED, CONST, VAR_CONST, POLY };
+
+// An instantiation template is a Poly compiled to its nodes in preorder, with
+// the bound variables replaced by numbered holes. HOLE and LOAD read a hole or
+// a register, SHARED is a subtree without bound variables that every instance
+// shares, and CONST, VAR_CONST (whose head comes first) and POLY build a node
+// from the n templates that follow. POLY binds the n holes starting at x. A
+// built node is kept in register save when it is reached again.
+struct InstOp {
+  InstOpType T;
+  uint32_t x, n, save;
+  uint32_t D;
+  Ref<Mono> t;
+  Ref<Kind> kind;
+};
+
+struct Template {
+  uint32_t holes, regs;
+  vector<Ref<Mono>> alphas;
+  vector<InstOp> code;
+};
+
+struct Names {
+  vector<string> names;
+  unordered_map<string, uint32_t> ids;
+};
+
+Names &names() {
+  static Names n;
+  return n;
 }
 
-shared_ptr<Mono> find(shared_ptr<Mono> x) {
-  if (x->par != nullptr) {
-    x->par = find(x->par);
-    return x->par;
+uint32_t intern(const string &name) {
+  auto &n = names();
+  auto it = n.ids.find(name);
+  if (it != n.ids.end()) {
+    return it->second;
   } else {
-    return x;
+    n.names.push_back(name);
+    return n.ids[name] = n.names.size() - 1;
   }
 }
 
-shared_ptr<Kind> find(shared_ptr<Kind> x) {
-  if (x->par != nullptr) {
-    x->par = find(x->par);
-    return x->par;
-  } else {
-    return x;
+const string &name_of(uint32_t id) { return names().names[id]; }
+
+const uint32_t ARROW = intern("->");
+
+thread_local uint32_t current_level = 0;
+atomic<uint32_t> current_visit(0);
+
+// Each traversal that must visit a shared node only once takes a fresh stamp
+// and records it in Mono::visit. Stamps are unique across threads.
+uint32_t new_visit() { return ++current_visit; }
+
+void enter_level() { current_level++; }
+void leave_level() { current_level--; }
+
+bool is_c(Ref<Mono> x) { return x->is_const; }
+bool is_cd(Ref<Mono> x) {
+  return x->is_const && !x->is_poly && x->D.is_const;
+}
+bool is_p(Ref<Mono> x) { return x->is_const && x->is_poly; }
+bool is_f(Ref<Mono> x) { return (!x->is_const) && x->is_forall; }
+bool is_e(Ref<Mono> x) { return (!x->is_const) && (!x->is_forall); }
+bool is_fun(Ref<Mono> x) {
+  return x->is_const && !x->is_poly && is_cd(x) && x->D.D == ARROW;
+}
+
+// Finds the root of x, then points every node on the way directly at it. A
+// node that already points at the root is not written, so that frozen types
+// can be read from several threads.
+template <typename T>
+Ref<T> find(Ref<T> x) {
+  auto r = x;
+  uint64_t chain = 0;
+  while (r->par != nullptr) {
+    r = r->par;
+    chain++;
   }
+  if (stats_enabled && chain > thread_stats.max_chain) {
+    thread_stats.max_chain = chain;
+  }
+  while (x != r) {
+    auto p = x->par;
+    if (p != r) {
+      x->par = r;
+    }
+    x = p;
+  }
+  return r;
 }
 
-string to_string(shared_ptr<Kind> kind) {
+string to_string(Ref<Kind> kind) {
   kind = find(kind);
   if (kind->is_const) {
     if (kind->is_arrow) {
@@ -88,9 +166,9 @@ string to_string(shared_ptr<Kind> kind) {
   }
 }
 
-string to_string(shared_ptr<Poly>);
+string to_string(Ref<Poly>);
 
-string to_string(shared_ptr<Mono> tau, bool fp = false, bool dp = false) {
+string to_string(Ref<Mono> tau, bool fp = false, bool dp = false) {
   tau = find(tau);
   if (is_c(tau)) {
     if (is_p(tau)) {
@@ -102,7 +180,7 @@ string to_string(shared_ptr<Mono> tau, bool fp = false, bool dp = false) {
       } else {
         string ret;
         if (is_cd(tau)) {
-          ret = tau->D.D;
+          ret = name_of(tau->D.D);
         } else {
           ret = to_string(tau->D.d);
         }
@@ -120,7 +198,7 @@ string to_string(shared_ptr<Mono> tau, bool fp = false, bool dp = false) {
   }
 }
 
-string to_string(shared_ptr<Poly> sigma) {
+string to_string(Ref<Poly> sigma) {
   if (sigma->is_mono) {
     return to_string(sigma->tau);
   } else {
@@ -131,21 +209,26 @@ string to_string(shared_ptr<Poly> sigma) {
   }
 }
 
-shared_ptr<Kind> new_kind() {
-  auto k = make_shared<Kind>();
+Ref<Kind> new_kind() {
+  auto k = Ref<Kind>::make();
   k->is_const = false;
   return k;
 }
 
-shared_ptr<Kind> new_const_kind() {
-  auto k = make_shared<Kind>();
-  k->is_const = true;
-  k->k = "*";
-  return k;
+Ref<Kind> const_kind;
+
+Ref<Kind> new_const_kind() {
+  // `*` is never bound, so a single node can be shared by all its uses
+  if (const_kind == nullptr) {
+    const_kind = Ref<Kind>::make();
+    const_kind->is_const = true;
+    const_kind->k = "*";
+  }
+  return const_kind;
 }
 
-shared_ptr<Kind> new_kind(shared_ptr<Kind> l, shared_ptr<Kind> r) {
-  auto k = make_shared<Kind>();
+Ref<Kind> new_kind(Ref<Kind> l, Ref<Kind> r) {
+  auto k = Ref<Kind>::make();
   k->is_const = true;
   k->is_arrow = true;
   k->left = l;
@@ -153,8 +236,8 @@ shared_ptr<Kind> new_kind(shared_ptr<Kind> l, shared_ptr<Kind> r) {
   return k;
 }
 
-shared_ptr<Mono> new_const(const string &D, shared_ptr<Kind> kind) {
-  auto t = make_shared<Mono>();
+Ref<Mono> new_const(uint32_t D, Ref<Kind> kind) {
+  auto t = Ref<Mono>::make();
   t->kind = kind;
   t->is_const = true;
   t->is_poly = false;
@@ -163,8 +246,12 @@ shared_ptr<Mono> new_const(const string &D, shared_ptr<Kind> kind) {
   return t;
 }
 
-shared_ptr<Mono> new_const(shared_ptr<Mono> d, shared_ptr<Kind> kind) {
-  auto t = make_shared<Mono>();
+Ref<Mono> new_const(const string &D, Ref<Kind> kind) {
+  return new_const(intern(D), kind);
+}
+
+Ref<Mono> new_const(Ref<Mono> d, Ref<Kind> kind) {
+  auto t = Ref<Mono>::make();
   t->kind = kind;
   t->is_const = true;
   t->is_poly = false;
@@ -173,8 +260,8 @@ shared_ptr<Mono> new_const(shared_ptr<Mono> d, shared_ptr<Kind> kind) {
   return t;
 }
 
-shared_ptr<Mono> new_const(shared_ptr<Poly> sigma, shared_ptr<Kind> kind) {
-  auto t = make_shared<Mono>();
+Ref<Mono> new_const(Ref<Poly> sigma, Ref<Kind> kind) {
+  auto t = Ref<Mono>::make();
   t->kind = kind;
   t->is_const = true;
   t->is_poly = true;
@@ -182,110 +269,184 @@ shared_ptr<Mono> new_const(shared_ptr<Poly> sigma, shared_ptr<Kind> kind) {
   return t;
 }
 
-shared_ptr<Mono> new_fun() { return new_const("->", new_const_kind()); }
+Ref<Mono> new_fun() { return new_const(ARROW, new_const_kind()); }
 
-shared_ptr<Mono> new_forall_var(shared_ptr<Kind> kind) {
-  auto t = make_shared<Mono>();
+struct GroundHash {
+  size_t operator()(const vector<uint32_t> &key) const {
+    size_t h = key.size();
+    for (auto k : key) {
+      h = h * 1000003 ^ k;
+    }
+    return h;
+  }
+};
+
+thread_local unordered_map<vector<uint32_t>, Ref<Mono>, GroundHash> grounds;
+
+// Closed ground types are shared: if every argument of the constant t is
+// itself a shared ground type, t is replaced by the unique node for it.
+Ref<Mono> hash_cons(Ref<Mono> t) {
+  if (!is_cd(t)) {
+    return t;
+  }
+  vector<uint32_t> key;
+  key.push_back(t->D.D);
+  for (auto a : t->tau) {
+    if (!a->is_ground) {
+      return t;
+    }
+    key.push_back(a.id);
+  }
+  auto it = grounds.find(key);
+  if (it != grounds.end()) {
+    return it->second;
+  } else {
+    t->is_ground = true;
+    return grounds[key] = t;
+  }
+}
+
+Ref<Mono> new_forall_var(Ref<Kind> kind) {
+  auto t = Ref<Mono>::make();
   t->kind = kind;
   t->is_const = false;
   t->is_forall = true;
+  t->level = current_level;
   return t;
 }
 
-shared_ptr<Mono> new_exists_var(shared_ptr<Kind> kind) {
-  auto t = make_shared<Mono>();
+Ref<Mono> new_exists_var(Ref<Kind> kind) {
+  auto t = Ref<Mono>::make();
   t->kind = kind;
   t->is_const = false;
   t->is_forall = false;
+  t->level = current_level;
   return t;
 }
 
-shared_ptr<Poly> new_poly(shared_ptr<Mono> m) {
-  auto p = make_shared<Poly>();
+Ref<Poly> new_poly(Ref<Mono> m) {
+  auto p = Ref<Poly>::make();
   p->is_mono = true;
   p->tau = m;
   return p;
 }
 
-shared_ptr<Poly> new_poly(shared_ptr<Mono> alpha, shared_ptr<Poly> sigma) {
-  auto p = make_shared<Poly>();
+Ref<Poly> new_poly(Ref<Mono> alpha, Ref<Poly> sigma) {
+  auto p = Ref<Poly>::make();
   p->is_mono = false;
   p->alpha = alpha;
   p->sigma = sigma;
   return p;
 }
 
-shared_ptr<Mono> get_mono(shared_ptr<Poly> t) {
+void free_types() {
+  const_kind = nullptr;
+  grounds.clear();
+  Arena<Kind>::clear();
+  Arena<Mono>::clear();
+  Arena<Poly>::clear();
+  Arena<Template>::clear();
+}
+
+Ref<Mono> get_mono(Ref<Poly> t) {
   while (!t->is_mono) {
     t = t->sigma;
   }
   return t->tau;
 }
 
-shared_ptr<Mono> inst_get_set(shared_ptr<Poly> sigma,
-                              map<shared_ptr<Mono>, shared_ptr<Mono>> &m,
-                              set<shared_ptr<Mono>> &st);
-
-shared_ptr<Mono> inst(shared_ptr<Mono> tau,
-                      map<shared_ptr<Mono>, shared_ptr<Mono>> &m) {
-  tau = find(tau);
-  if (is_c(tau)) {
-    if (is_p(tau)) {
-      set<shared_ptr<Mono>> st;
-      auto mo = inst_get_set(tau->sigma, m, st);
-      auto po = new_poly(mo);
-      for (auto f : st) {
-        po = new_poly(f, po);
+Ref<Mono> inst_get_set(Ref<Poly> sigma, map<Ref<Mono>, Ref<Mono>> &m,
+                       set<Ref<Mono>> &st);
+
+// Copies tau with the variables in m substituted. Subtrees that do not change
+// are returned as they are, and every node is copied at most once per call so
+// that shared subterms stay shared. The copy is built bottom-up on an explicit
+// stack, so a deep type does not overflow the native one.
+//
+// m always holds the variables bound by the Poly nodes tau is under, so a
+// subtree that does not change mentions no bound variable. Bound variables
+// never escape their Poly, so this is cached as no_bound.
+Ref<Mono> inst_(Ref<Mono> tau, map<Ref<Mono>, Ref<Mono>> &m, uint32_t visit) {
+  vector<pair<Ref<Mono>, bool>> stack;
+  vector<Ref<Mono>> out;
+  stack.push_back(make_pair(find(tau), false));
+  while (!stack.empty()) {
+    tau = stack.back().first;
+    if (tau->is_ground) {
+      out.push_back(tau);
+    } else if (!is_c(tau)) {
+      out.push_back(m.count(tau) ? m[tau] : tau);
+    } else if (tau->visit == visit) {
+      out.push_back(tau->copy);
+    } else if (!stack.back().second) {
+      if (is_p(tau)) {
+        set<Ref<Mono>> st;
+        auto mo = inst_get_set(tau->sigma, m, st);
+        auto po = new_poly(mo);
+        for (auto f : st) {
+          po = new_poly(f, po);
+        }
+        tau->visit = visit;
+        tau->copy = new_const(po, mo->kind);
+        out.push_back(tau->copy);
+      } else {
+        stack.back().second = true;
+        for (size_t i = tau->tau.size(); i-- > 0;) {
+          stack.push_back(make_pair(find(tau->tau[i]), false));
+        }
+        continue;
       }
-      return new_const(po, mo->kind);
     } else {
-      shared_ptr<Mono> t;
-      if (is_cd(tau)) {
-        t = new_const(tau->D.D, tau->kind);
-      } else {
-        auto d = find(tau->D.d);
+      size_t n = tau->tau.size();
+      auto ts = out.end() - n;
+      bool changed = false;
+      Ref<Mono> d;
+      if (!is_cd(tau)) {
+        d = find(tau->D.d);
         if (m.count(d)) {
-          t = new_const(m[d], tau->kind);
+          d = m[d];
+          changed = true;
+        }
+      }
+      for (size_t i = 0; i < n; i++) {
+        if (ts[i] != find(tau->tau[i])) {
+          changed = true;
+        }
+      }
+      Ref<Mono> t;
+      if (!changed) {
+        t = tau;
+        tau->no_bound = true;
+      } else {
+        if (is_cd(tau)) {
+          t = new_const(tau->D.D, tau->kind);
         } else {
           t = new_const(d, tau->kind);
         }
+        for (size_t i = 0; i < n; i++) {
+          t->tau.push_back(ts[i]);
+        }
+        t = hash_cons(t);
       }
-      for (size_t i = 0; i < tau->tau.size(); i++) {
-        t->tau.push_back(inst(tau->tau[i], m));
-      }
-      return t;
-    }
-  } else {
-    if (m.count(tau)) {
-      return m[tau];
-    } else {
-      return tau;
+      out.resize(out.size() - n);
+      tau->visit = visit;
+      tau->copy = t;
+      out.push_back(t);
     }
+    stack.pop_back();
   }
+  return out.back();
 }
 
-shared_ptr<Mono> inst(shared_ptr<Poly> sigma,
-                      map<shared_ptr<Mono>, shared_ptr<Mono>> &m) {
-  if (sigma->is_mono) {
-    return inst(sigma->tau, m);
-  } else {
-    if (!m.count(sigma->alpha)) {
-      m[sigma->alpha] = new_forall_var(sigma->alpha->kind);
-    } else {
-      assert(is_e(m[sigma->alpha]));
-    }
-    return inst(sigma->sigma, m);
+Ref<Mono> inst(Ref<Mono> tau, map<Ref<Mono>, Ref<Mono>> &m) {
+  if (stats_enabled) {
+    thread_stats.inst++;
   }
+  return inst_(tau, m, new_visit());
 }
 
-shared_ptr<Mono> inst(shared_ptr<Poly> sigma) {
-  map<shared_ptr<Mono>, shared_ptr<Mono>> m;
-  return inst(sigma, m);
-}
-
-shared_ptr<Mono> inst_get_set(shared_ptr<Poly> sigma,
-                              map<shared_ptr<Mono>, shared_ptr<Mono>> &m,
-                              set<shared_ptr<Mono>> &st) {
+Ref<Mono> inst_get_set(Ref<Poly> sigma, map<Ref<Mono>, Ref<Mono>> &m,
+                       set<Ref<Mono>> &st) {
   if (sigma->is_mono) {
     return inst(sigma->tau, m);
   } else {
@@ -301,50 +462,408 @@ shared_ptr<Mono> inst_get_set(shared_ptr<Poly> sigma,
   }
 }
 
-shared_ptr<Mono> inst_get_set(shared_ptr<Poly> sigma,
-                              set<shared_ptr<Mono>> &st) {
-  map<shared_ptr<Mono>, shared_ptr<Mono>> m;
-  return inst_get_set(sigma, m, st);
+const uint32_t NO_REG = UINT32_MAX;
+
+bool compile_(Ref<Template> tpl, Ref<Mono> tau, map<Ref<Mono>, uint32_t> &hole,
+              unordered_map<uint32_t, size_t> &built);
+
+// Replaces the template of tau that starts at pc by a single SHARED op if it
+// mentions no bound variable, or else records where it is built.
+bool compile_end(Ref<Template> tpl, Ref<Mono> tau, size_t pc, bool shared,
+                 unordered_map<uint32_t, size_t> &built) {
+  if (shared) {
+    InstOp op = InstOp();
+    op.T = InstOpType::SHARED;
+    op.save = NO_REG;
+    op.t = tau;
+    tpl->code.resize(pc);
+    tpl->code.push_back(op);
+    tau->no_bound = true;
+  } else {
+    built[tau.id] = pc;
+  }
+  return shared;
+}
+
+bool compile_poly(Ref<Template> tpl, Ref<Mono> tau,
+                  map<Ref<Mono>, uint32_t> &hole,
+                  unordered_map<uint32_t, size_t> &built) {
+  size_t pc = tpl->code.size();
+  InstOp op = InstOp();
+  op.T = InstOpType::POLY;
+  op.save = NO_REG;
+  op.x = tpl->alphas.size();
+  op.n = 0;
+  map<Ref<Mono>, uint32_t> outer;
+  auto sigma = tau->sigma;
+  for (; !sigma->is_mono; sigma = sigma->sigma) {
+    if (hole.count(sigma->alpha)) {
+      outer[sigma->alpha] = hole[sigma->alpha];
+    }
+    hole[sigma->alpha] = tpl->alphas.size();
+    tpl->alphas.push_back(sigma->alpha);
+    op.n++;
+  }
+  tpl->code.push_back(op);
+  bool shared = compile_(tpl, sigma->tau, hole, built);
+  for (uint32_t i = op.x; i < op.x + op.n; i++) {
+    hole.erase(tpl->alphas[i]);
+  }
+  for (auto &o : outer) {
+    hole[o.first] = o.second;
+  }
+  return compile_end(tpl, tau, pc, shared, built);
+}
+
+// Emits the template of tau and returns whether it is a single SHARED op,
+// i.e. whether tau mentions no bound variable. A node with bound variables
+// that is reached twice is built once and loaded from a register afterwards.
+// The nodes are walked on an explicit stack; only nested Poly nodes recurse.
+bool compile_(Ref<Template> tpl, Ref<Mono> tau, map<Ref<Mono>, uint32_t> &hole,
+              unordered_map<uint32_t, size_t> &built) {
+  struct Frame {
+    Ref<Mono> tau;
+    size_t pc;
+    uint32_t next;
+    bool shared;
+  };
+  auto &code = tpl->code;
+  vector<Frame> stack;
+  for (;;) {
+    tau = find(tau);
+    InstOp op = InstOp();
+    op.save = NO_REG;
+    bool shared = false, done = true;
+    if (tau->is_ground || tau->no_bound ||
+        (!is_c(tau) && !hole.count(tau))) {
+      op.T = InstOpType::SHARED;
+      op.t = tau;
+      code.push_back(op);
+      shared = true;
+    } else if (!is_c(tau)) {
+      op.T = InstOpType::HOLE;
+      op.x = hole[tau];
+      code.push_back(op);
+    } else if (built.count(tau.id)) {
+      auto &first = code[built[tau.id]];
+      if (first.save == NO_REG) {
+        first.save = tpl->regs++;
+      }
+      op.T = InstOpType::LOAD;
+      op.x = first.save;
+      code.push_back(op);
+    } else if (is_p(tau)) {
+      shared = compile_poly(tpl, tau, hole, built);
+    } else {
+      op.n = tau->tau.size();
+      op.kind = tau->kind;
+      if (is_cd(tau)) {
+        op.T = InstOpType::CONST;
+        op.D = tau->D.D;
+      } else {
+        op.T = InstOpType::VAR_CONST;
+      }
+      Frame f = {tau, code.size(), 0, true};
+      code.push_back(op);
+      stack.push_back(f);
+      done = false;
+    }
+    for (;;) {
+      if (stack.empty()) {
+        return shared;
+      }
+      auto &f = stack.back();
+      if (done) {
+        f.shared = f.shared && shared;
+      }
+      if (is_cd(f.tau) && f.next < f.tau->tau.size()) {
+        tau = f.tau->tau[f.next++];
+        break;
+      } else if (!is_cd(f.tau) && f.next <= f.tau->tau.size()) {
+        tau = f.next == 0 ? f.tau->D.d : f.tau->tau[f.next - 1];
+        f.next++;
+        break;
+      }
+      auto g = f;
+      stack.pop_back();
+      shared = compile_end(tpl, g.tau, g.pc, g.shared, built);
+      done = true;
+    }
+  }
 }
 
-shared_ptr<Mono> inst_with_exists(shared_ptr<Poly> sigma,
-                                  set<shared_ptr<Mono>> &exists,
-                                  set<shared_ptr<Mono>> &exists_var) {
-  map<shared_ptr<Mono>, shared_ptr<Mono>> m;
-  for (auto e : exists) {
-    m[e] = new_exists_var(e->kind);
-    exists_var.insert(m[e]);
+// Templates are compiled on the first instantiation of a Poly and reused by
+// every later one.
+Ref<Template> get_template(Ref<Poly> sigma) {
+  if (sigma->tpl == nullptr) {
+    auto tpl = Ref<Template>::make();
+    map<Ref<Mono>, uint32_t> hole;
+    unordered_map<uint32_t, size_t> built;
+    auto s = sigma;
+    for (; !s->is_mono; s = s->sigma) {
+      if (!hole.count(s->alpha)) {
+        hole[s->alpha] = tpl->alphas.size();
+        tpl->alphas.push_back(s->alpha);
+      }
+    }
+    tpl->holes = tpl->alphas.size();
+    compile_(tpl, s->tau, hole, built);
+    sigma->tpl = tpl;
   }
-  return inst(sigma, m);
+  return sigma->tpl;
 }
 
-void ftv(set<shared_ptr<Mono>> &, shared_ptr<Poly>);
+// Replays the template starting at pc. Nodes whose arguments are still being
+// built wait on an explicit stack; only POLY recurses, for its body.
+Ref<Mono> run(Ref<Template> tpl, size_t &pc, vector<Ref<Mono>> &holes,
+              vector<Ref<Mono>> &regs) {
+  struct Frame {
+    Ref<Mono> t;
+    uint32_t left, save;
+    bool head;
+  };
+  vector<Frame> stack;
+  for (;;) {
+    const InstOp &op = tpl->code[pc++];
+    Ref<Mono> t;
+    switch (op.T) {
+      case InstOpType::HOLE:
+        t = holes[op.x];
+        break;
+      case InstOpType::LOAD:
+        t = regs[op.x];
+        break;
+      case InstOpType::SHARED:
+        t = op.t;
+        break;
+      case InstOpType::CONST:
+        t = new_const(op.D, op.kind);
+        break;
+      case InstOpType::VAR_CONST:
+        t = new_const(Ref<Mono>(), op.kind);
+        break;
+      case InstOpType::POLY: {
+        for (uint32_t i = op.x; i < op.x + op.n; i++) {
+          holes[i] = new_forall_var(tpl->alphas[i]->kind);
+        }
+        auto mo = run(tpl, pc, holes, regs);
+        auto po = new_poly(mo);
+        for (uint32_t i = op.x; i < op.x + op.n; i++) {
+          po = new_poly(holes[i], po);
+        }
+        t = new_const(po, mo->kind);
+      } break;
+    }
+    if ((op.T == InstOpType::CONST && op.n > 0) ||
+        op.T == InstOpType::VAR_CONST) {
+      Frame f = {t, op.n, op.save, op.T == InstOpType::VAR_CONST};
+      stack.push_back(f);
+      continue;
+    }
+    if (op.save != NO_REG) {
+      regs[op.save] = t;
+    }
+    for (;;) {
+      if (stack.empty()) {
+        return t;
+      }
+      auto &f = stack.back();
+      if (f.head) {
+        f.t->D.d = t;
+        f.head = false;
+      } else {
+        f.t->tau.push_back(t);
+        f.left--;
+      }
+      if (f.left > 0) {
+        break;
+      }
+      t = f.t;
+      if (f.save != NO_REG) {
+        regs[f.save] = t;
+      }
+      stack.pop_back();
+    }
+  }
+}
 
-void ftv(set<shared_ptr<Mono>> &f, shared_ptr<Mono> tau) {
-  tau = find(tau);
-  if (is_c(tau)) {
-    if (is_p(tau)) {
-      ftv(f, tau->sigma);
+// Instantiates tpl with holes[i] for its i-th bound variable.
+Ref<Mono> inst(Ref<Template> tpl, vector<Ref<Mono>> &holes) {
+  holes.resize(tpl->alphas.size());
+  vector<Ref<Mono>> regs(tpl->regs);
+  size_t pc = 0;
+  return run(tpl, pc, holes, regs);
+}
+
+Ref<Mono> inst(Ref<Poly> sigma) {
+  if (stats_enabled) {
+    thread_stats.inst++;
+  }
+  auto tpl = get_template(sigma);
+  vector<Ref<Mono>> holes;
+  for (uint32_t i = 0; i < tpl->holes; i++) {
+    holes.push_back(new_forall_var(tpl->alphas[i]->kind));
+  }
+  return inst(tpl, holes);
+}
+
+Ref<Mono> inst_get_set(Ref<Poly> sigma, set<Ref<Mono>> &st) {
+  if (stats_enabled) {
+    thread_stats.inst++;
+  }
+  auto tpl = get_template(sigma);
+  vector<Ref<Mono>> holes;
+  for (uint32_t i = 0; i < tpl->holes; i++) {
+    holes.push_back(new_forall_var(tpl->alphas[i]->kind));
+    st.insert(holes.back());
+  }
+  return inst(tpl, holes);
+}
+
+Ref<Mono> inst_with_exists(Ref<Poly> sigma, set<Ref<Mono>> &exists,
+                           set<Ref<Mono>> &exists_var) {
+  if (stats_enabled) {
+    thread_stats.inst++;
+  }
+  auto tpl = get_template(sigma);
+  vector<Ref<Mono>> holes;
+  for (uint32_t i = 0; i < tpl->holes; i++) {
+    auto alpha = tpl->alphas[i];
+    if (exists.count(alpha)) {
+      holes.push_back(new_exists_var(alpha->kind));
+      exists_var.insert(holes.back());
     } else {
-      if (!is_cd(tau)) {
-        ftv(f, tau->D.d);
+      holes.push_back(new_forall_var(alpha->kind));
+    }
+  }
+  return inst(tpl, holes);
+}
+
+void ftv(set<Ref<Mono>> &, Ref<Poly>, uint32_t);
+
+void ftv(set<Ref<Mono>> &f, Ref<Mono> tau, uint32_t visit) {
+  vector<Ref<Mono>> stack(1, tau);
+  while (!stack.empty()) {
+    tau = find(stack.back());
+    stack.pop_back();
+    if (tau->is_ground) {
+      continue;
+    }
+    if (is_c(tau)) {
+      if (tau->visit == visit) {
+        continue;
       }
-      for (size_t i = 0; i < tau->tau.size(); i++) {
-        ftv(f, tau->tau[i]);
+      tau->visit = visit;
+      if (is_p(tau)) {
+        ftv(f, tau->sigma, visit);
+      } else {
+        if (!is_cd(tau)) {
+          stack.push_back(tau->D.d);
+        }
+        for (size_t i = 0; i < tau->tau.size(); i++) {
+          stack.push_back(tau->tau[i]);
+        }
       }
+    } else {
+      f.insert(tau);
     }
-  } else {
-    f.insert(tau);
   }
 }
 
-void ftv(set<shared_ptr<Mono>> &f, shared_ptr<Poly> sigma) {
+void ftv(set<Ref<Mono>> &f, Ref<Poly> sigma, uint32_t visit) {
   if (sigma->is_mono) {
-    ftv(f, sigma->tau);
+    ftv(f, sigma->tau, visit);
   } else {
-    ftv(f, sigma->sigma);
+    ftv(f, sigma->sigma, visit);
     f.erase(sigma->alpha);
   }
 }
 
+void ftv(set<Ref<Mono>> &f, Ref<Mono> tau) {
+  if (stats_enabled) {
+    thread_stats.ftv++;
+  }
+  ftv(f, tau, new_visit());
+}
+
+void ftv(set<Ref<Mono>> &f, Ref<Poly> sigma) {
+  if (stats_enabled) {
+    thread_stats.ftv++;
+  }
+  ftv(f, sigma, new_visit());
+}
+
+// A frozen kind or type is shared between threads and must never be written
+// again. A kind is frozen once it has no variables left, with every link
+// resolved; a type is frozen by marking every node in it is_ground, which
+// makes each traversal above stop there. Freezing fails on a type that still
+// has variables or nested Poly nodes in it.
+bool freeze(Ref<Kind> &k) {
+  auto r = find(k);
+  if (k != r) {
+    k = r;
+  }
+  if (!k->is_const) {
+    return false;
+  }
+  return !k->is_arrow || (freeze(k->left) && freeze(k->right));
+}
+
+bool freeze(Ref<Mono> tau) {
+  auto visit = new_visit();
+  vector<pair<Ref<Mono>, bool>> stack;
+  stack.push_back(make_pair(find(tau), false));
+  while (!stack.empty()) {
+    tau = stack.back().first;
+    if (tau->is_ground || tau->visit == visit) {
+      stack.pop_back();
+    } else if (!is_c(tau) || is_p(tau) || !freeze(tau->kind)) {
+      return false;
+    } else if (!stack.back().second) {
+      stack.back().second = true;
+      if (!is_cd(tau)) {
+        auto d = find(tau->D.d);
+        if (!is_cd(d)) {
+          return false;
+        }
+        SmallVector<Ref<Mono>, 2> ts = d->tau;
+        for (auto t : tau->tau) {
+          ts.push_back(t);
+        }
+        tau->D.is_const = true;
+        tau->D.D = d->D.D;
+        tau->tau = ts;
+      }
+      for (auto &t : tau->tau) {
+        t = find(t);
+        stack.push_back(make_pair(t, false));
+      }
+    } else {
+      tau->visit = visit;
+      tau->is_ground = true;
+      stack.pop_back();
+    }
+  }
+  return true;
+}
+
+// Compiles the template of sigma and freezes everything its instances share.
+bool freeze(Ref<Poly> sigma) {
+  auto tpl = get_template(sigma);
+  for (auto alpha : tpl->alphas) {
+    if (!freeze(alpha->kind)) {
+      return false;
+    }
+  }
+  for (auto &op : tpl->code) {
+    if (op.kind != nullptr && !freeze(op.kind)) {
+      return false;
+    }
+    if (op.T == InstOpType::SHARED && !freeze(op.t)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 #endif
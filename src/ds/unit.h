@@ -2,18 +2,39 @@
 #define SU_BOLEYN_BSL_DS_UNIT_H
 
 #include <cassert>
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "data.h"
+#include "expr.h"
+#include "position.h"
+#include "type.h"
 
-struct Expr;
+// A module the unit imports, with the schemes of the values it exports.
+struct Import {
+  string module;
+  Position pos;
+  vector<pair<string, Ref<Poly>>> values;
+};
 
 struct Unit {
+  vector<Import> imports;
+  // the name of the unit if it is compiled as a module rather than as the
+  // main program, and the names its own top-level bindings export
+  string module;
+  set<string> exports;
   map<string, shared_ptr<Data>> data;
   map<string, shared_ptr<Constructor>> cons;
-  shared_ptr<Expr> expr;
+  // the nodes of expr, which live as long as the unit
+  ExprArena arena;
+  Expr *expr = nullptr;
+  // the number of slots the binders in the unit take
+  uint32_t slots = 0;
 };
 
 #endif
@@ -8,12 +8,14 @@
 #include <string>
 
 #include "ds/position.h"
+#include "ds/source.h"
+#include "ds/string_view.h"
+#include "scan.h"
 
 using namespace std;
 
 enum class TokenType {
-  HASHBANG,
-
+  IMPORT,
   DATA,
   FORALL,
   DOT,
@@ -38,16 +40,14 @@ enum class TokenType {
 
   IDENTIFIER,
 
-  SPACE,
-  COMMENT,
   END,
 
   ERROR
 };
 ostream &operator<<(ostream &out, TokenType t) {
   switch (t) {
-    case TokenType::HASHBANG:
-      out << "HASHBANG";
+    case TokenType::IMPORT:
+      out << "IMPORT";
       break;
     case TokenType::DATA:
       out << "DATA";
@@ -109,12 +109,6 @@ ostream &operator<<(ostream &out, TokenType t) {
     case TokenType::IDENTIFIER:
       out << "IDENTIFIER";
       break;
-    case TokenType::SPACE:
-      out << "SPACE";
-      break;
-    case TokenType::COMMENT:
-      out << "COMMENT";
-      break;
     case TokenType::END:
       out << "END";
       break;
@@ -127,319 +121,224 @@ ostream &operator<<(ostream &out, TokenType t) {
 
 struct Token {
   TokenType token_type;
-  string data;
   Position position;
+  StringView data;
 };
 
+bool is_identifier_begin(char c) {
+  return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_';
+}
+bool is_identifier(char c) {
+  return is_identifier_begin(c) || ('0' <= c && c <= '9') || c == '\'';
+}
+
+// Keywords are told apart by their length and first letter, so that an
+// identifier is compared with at most one of them.
+TokenType keyword(StringView s) {
+  const char *k = nullptr;
+  TokenType t = TokenType::IDENTIFIER;
+  switch (s.size()) {
+    case 2:
+      switch (s[0]) {
+        case 'i':
+          k = "in";
+          t = TokenType::IN;
+          break;
+        case 'o':
+          k = "of";
+          t = TokenType::OF;
+          break;
+      }
+      break;
+    case 3:
+      switch (s[0]) {
+        case 'l':
+          k = "let";
+          t = TokenType::LET;
+          break;
+        case 'r':
+          k = "rec";
+          t = TokenType::REC;
+          break;
+        case 'a':
+          k = "and";
+          t = TokenType::AND;
+          break;
+        case 'f':
+          k = "ffi";
+          t = TokenType::FFI;
+          break;
+      }
+      break;
+    case 4:
+      switch (s[0]) {
+        case 'd':
+          k = "data";
+          t = TokenType::DATA;
+          break;
+        case 'c':
+          k = "case";
+          t = TokenType::CASE;
+          break;
+      }
+      break;
+    case 6:
+      switch (s[0]) {
+        case 'f':
+          k = "forall";
+          t = TokenType::FORALL;
+          break;
+        case 'i':
+          k = "import";
+          t = TokenType::IMPORT;
+          break;
+      }
+      break;
+  }
+  return k != nullptr && s == k ? t : TokenType::IDENTIFIER;
+}
+
+// Tokens are views into the source, which is mapped rather than read, so the
+// lexer copies no text. They are made only as the parser looks at them, and
+// blanks, comments and the leading `#!` line are skipped rather than made
+// into tokens.
 struct Lexer {
-  string filename;
-  istream &in;
+  uint32_t file;
+  const char *data, *p, *end;
+  const Scanner &scan;
+  // the tokens looked at but not taken yet
   deque<Token> tokens;
-  Lexer(const string &filename, istream &in) : filename(filename), in(in) {
+  Lexer(const string &filename) : Lexer(open_source(filename)) {}
+  Lexer(uint32_t file)
+      : file(file),
+        data(source(file).data),
+        p(data),
+        end(data + source(file).size),
+        scan(scanner()) {
+    if (p + 1 < end && p[0] == '#' && p[1] == '!') {
+      while (p < end && *p != '\n' && *p != '\r') {
+        p++;
+      }
+    }
+  }
+  const Token &look_at(size_t i) {
+    while (tokens.size() <= i) {
+      tokens.push_back(lex_token());
+    }
+    return tokens[i];
+  }
+  Token next() {
+    look_at(0);
+    Token token = tokens.front();
+    tokens.pop_front();
+    return token;
+  }
+  Position position(const char *begin) {
     Position position;
-    position.filename = filename;
-    position.endRow = 1;
-    position.endColumn = 1;
+    position.file = file;
+    position.begin = begin - data;
+    position.end = p - data;
+    return position;
+  }
+  // Reports the text from begin to p.
+  [[noreturn]] void fail(const char *begin) {
+    StringView text(begin, p - begin);
+    if (text.length() > 78) {
+      text = text.substr(0, 75);
+    }
+    cerr << "lexer: " << to_string(position(begin)) << " token not recognized"
+         << endl
+         << "`" << text << (text.size() < size_t(p - begin) ? "..." : "")
+         << "`" << endl;
+    exit(EXIT_FAILURE);
+  }
+  void skip() {
     for (;;) {
-      position.beginRow = position.endRow;
-      position.beginColumn = position.endColumn;
-      TokenType token_type;
-      string data;
-      char c = in.get();
-      if (c == EOF) {
-        break;
-      } else if (c == ' ' || c == '\t') {
-        data.push_back(c);
-        position.endColumn++;
-      } else if (c == '\n') {
-        data.push_back(c);
-        position.endColumn++;
-        position.endRow++;
-        position.endColumn = 1;
-      } else if (c == '\r') {
-        data.push_back(c);
-        position.endColumn++;
-        c = in.get();
-        if (c != EOF) {
-          if (c == '\n') {
-            data.push_back(c);
-            position.endColumn++;
-          } else {
-            in.putback(c);
-          }
-        }
-        position.endRow++;
-        position.endColumn = 1;
-      } else if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_') {
-        for (;;) {
-          data.push_back(c);
-          position.endColumn++;
-          c = in.get();
-          if (c == EOF) {
-            break;
-          }
-          if (!(('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
-                ('a' <= c && c <= 'z') || c == '_' || c == '\'')) {
-            in.putback(c);
-            break;
-          }
+      if (p + 1 < end && *p == ' ' && !is_space(p[1])) {
+        // a single space, too short to be worth a scan
+        p++;
+      } else if (p < end && is_space(*p)) {
+        p = scan.skip_blanks(p, end);
+      } else if (p + 1 < end && p[0] == '-' && p[1] == '-') {
+        p = scan.find_either(p, end, '\n', '\r');
+      } else if (p + 1 < end && p[0] == '{' && p[1] == '-') {
+        auto begin = p;
+        p = scan.find(p + 2, end, "-}", 2);
+        if (p == end) {
+          fail(begin);
         }
+        p += 2;
       } else {
-        data.push_back(c);
-        position.endColumn++;
-        if (c == '-') {
-          c = in.get();
-          if (c != EOF) {
-            if (c == '>') {  //"->"
-              data.push_back(c);
-              position.endColumn++;
-            } else if (c == '-') {  //"--"
-              data.push_back(c);
-              position.endColumn++;
-            } else {
-              in.putback(c);
-            }
-          }
-        } else if (c == '#') {
-          if (position.beginRow == 1 && position.beginColumn == 1) {
-            c = in.get();
-            if (c != EOF) {
-              if (c == '!') {  //"#!"
-                data.push_back(c);
-                position.endColumn++;
-              } else {
-                in.putback(c);
-              }
-            }
-          }
-        } else if (c == '{') {
-          c = in.get();
-          if (c != EOF) {
-            if (c == '-') {  //"{-"
-              data.push_back(c);
-              position.endColumn++;
-            } else {
-              in.putback(c);
-            }
-          }
-        }
+        return;
       }
-      if (data == "#!") {
-        for (;;) {
-          c = in.get();
-          if (c != EOF) {
-            if (c == '\n' || c == '\r') {
-              in.putback(c);
-              break;
-            } else {
-              data.push_back(c);
-              position.endColumn++;
-            }
-          } else {
-            break;
-          }
-        }
-        token_type = TokenType::HASHBANG;
-      } else if (data == "data") {
-        token_type = TokenType::DATA;
-      } else if (data == "forall") {
-        token_type = TokenType::FORALL;
-      } else if (data == ".") {
-        token_type = TokenType::DOT;
-      } else if (data == ":") {
-        token_type = TokenType::COLON;
-      } else if (data == "->") {
-        token_type = TokenType::RIGHTARROW;
-      } else if (data == ";") {
-        token_type = TokenType::SEMICOLON;
-      } else if (data == "\\") {
-        token_type = TokenType::LAMBDA;
-      } else if (data == "let") {
-        token_type = TokenType::LET;
-      } else if (data == "=") {
-        token_type = TokenType::EQUAL;
-      } else if (data == "in") {
-        token_type = TokenType::IN;
-      } else if (data == "rec") {
-        token_type = TokenType::REC;
-      } else if (data == "and") {
-        token_type = TokenType::AND;
-      } else if (data == "case") {
-        token_type = TokenType::CASE;
-      } else if (data == "of") {
-        token_type = TokenType::OF;
-      } else if (data == "ffi") {
-        token_type = TokenType::FFI;
-        do {
-          data.push_back(c);
-          c = in.get();
-          if (c == EOF) {
-            break;
-          } else if (c == '\n') {
-            position.endRow++;
-            position.endColumn = 1;
-          } else if (c == '\r') {
-            c = in.get();
-            if (c != EOF) {
-              if (c == '\n') {
-                data.push_back(c);
-              } else {
-                in.putback(c);
-              }
-            }
-            position.endRow++;
-            position.endColumn = 1;
-          } else {
-            position.endColumn++;
-          }
-        } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
-        if (c == EOF) {
-          token_type = TokenType::ERROR;
-        } else {
-          string sep;
-          do {
-            data.push_back(c);
-            position.endColumn++;
-            sep.push_back(c);
-            c = in.get();
-            if (c == EOF) {
-              break;
-            }
-          } while (!(c == ' ' || c == '\t' || c == '\n' || c == '\r'));
-          if (c == EOF) {
-            token_type = TokenType::ERROR;
-          } else {
-            for (;;) {
-              data.push_back(c);
-              if (data.substr(data.size() - sep.size(), sep.size()) == sep) {
-                break;
-              }
-              c = in.get();
-              if (c == EOF) {
-                break;
-              } else if (c == '\n') {
-                position.endRow++;
-                position.endColumn = 1;
-              } else if (c == '\r') {
-                c = in.get();
-                if (c != EOF) {
-                  if (c == '\n') {
-                    data.push_back(c);
-                  } else {
-                    in.putback(c);
-                  }
-                }
-                position.endRow++;
-                position.endColumn = 1;
-              } else {
-                position.endColumn++;
-              }
-            }
-            if (c == EOF) {
-              token_type = TokenType::ERROR;
-            }
-          }
-        }
-      } else if (data == "(") {
-        token_type = TokenType::LEFT_PARENTHESIS;
-      } else if (data == ")") {
-        token_type = TokenType::RIGHT_PARENTHESIS;
-      } else if (data == "{") {
-        token_type = TokenType::LEFT_BRACE;
-      } else if (data == "}") {
-        token_type = TokenType::RIGHT_BRACE;
-      } else if (data == "--") {
-        for (;;) {
-          c = in.get();
-          if (c != EOF) {
-            if (c == '\n' || c == '\r') {
-              in.putback(c);
-              break;
-            } else {
-              data.push_back(c);
-              position.endColumn++;
-            }
-          } else {
-            break;
-          }
-        }
-        token_type = TokenType::COMMENT;
-      } else if (data == "{-") {
-        token_type = TokenType::COMMENT;
-        for (;;) {
-          c = in.get();
-          if (c != EOF) {
-            if (c == '-') {
-              data.push_back(c);
-              position.endColumn++;
-              c = in.get();
-              if (c != EOF) {
-                if (c == '}') {  //"-}"
-                  data.push_back(c);
-                  position.endColumn++;
-                  break;
-                } else {
-                  in.putback(c);
-                }
-              } else {
-                break;
-              }
-            } else {
-              data.push_back(c);
-              if (c == '\n') {
-                position.endRow++;
-                position.endColumn = 1;
-              } else if (c == '\r') {
-                c = in.get();
-                if (c != EOF) {
-                  if (c == '\n') {
-                    data.push_back(c);
-                  } else {
-                    in.putback(c);
-                  }
-                }
-                position.endRow++;
-                position.endColumn = 1;
-              } else {
-                position.endColumn++;
-              }
-              position.endColumn++;
-            }
-          } else {
-            break;
-          }
-        }
-        if (c == EOF) {
-          token_type = TokenType::ERROR;
-        }
-      } else {
-        c = data[0];
-        if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_') {
-          token_type = TokenType::IDENTIFIER;
-        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-          token_type = TokenType::SPACE;
-        } else {
-          token_type = TokenType::ERROR;
-        }
+    }
+  }
+  Token lex_token() {
+    skip();
+    auto begin = p;
+    auto token_type = p == end ? TokenType::END : lex();
+    if (token_type == TokenType::ERROR) {
+      fail(begin);
+    }
+    return {token_type, position(begin), StringView(begin, p - begin)};
+  }
+  // Moves p to the end of the token that starts at it.
+  TokenType lex() {
+    char c = *p++;
+    if (is_identifier_begin(c)) {
+      auto begin = p - 1;
+      while (p < end && is_identifier(*p)) {
+        p++;
       }
-      if (token_type == TokenType::ERROR) {
-        if (data.length() > 78) {
-          data = data.substr(0, 75) + "...";
+      auto token_type = keyword(StringView(begin, p - begin));
+      return token_type == TokenType::FFI ? lex_ffi() : token_type;
+    }
+    switch (c) {
+      case '.':
+        return TokenType::DOT;
+      case ':':
+        return TokenType::COLON;
+      case ';':
+        return TokenType::SEMICOLON;
+      case '\\':
+        return TokenType::LAMBDA;
+      case '=':
+        return TokenType::EQUAL;
+      case '(':
+        return TokenType::LEFT_PARENTHESIS;
+      case ')':
+        return TokenType::RIGHT_PARENTHESIS;
+      case '{':
+        return TokenType::LEFT_BRACE;
+      case '}':
+        return TokenType::RIGHT_BRACE;
+      case '-':
+        if (p < end && *p == '>') {
+          p++;
+          return TokenType::RIGHTARROW;
         }
-        cerr << "lexer: " << to_string(position) << " token not recognized"
-             << endl
-             << "`" << data << "`" << endl;
-        exit(EXIT_FAILURE);
-      }
-      tokens.push_back({token_type, data, position});
+        break;
     }
-    tokens.push_back({TokenType::END, "", position});
+    return TokenType::ERROR;
   }
-  Token look_at(size_t i) { return tokens[i]; }
-  Token next() {
-    Token token = tokens.front();
-    tokens.pop_front();
-    return token;
+  // An ffi block is `ffi`, blanks, a separator that runs up to the next
+  // blank, and the C source, which runs up to the next copy of the separator.
+  TokenType lex_ffi() {
+    p = scan.skip_blanks(p, end);
+    auto sep = p;
+    while (p < end && !is_space(*p)) {
+      p++;
+    }
+    if (p == end) {
+      return TokenType::ERROR;
+    }
+    size_t n = p - sep;
+    p = scan.find(p + 1, end, sep, n);
+    if (p == end) {
+      return TokenType::ERROR;
+    }
+    p += n;
+    return TokenType::FFI;
   }
 };
 
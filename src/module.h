@@ -0,0 +1,361 @@
+#ifndef SU_BOLEYN_BSL_MODULE_H
+#define SU_BOLEYN_BSL_MODULE_H
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "code_generate.h"
+#include "ds/data.h"
+#include "ds/expr.h"
+#include "ds/position.h"
+#include "ds/source.h"
+#include "ds/unit.h"
+#include "lex.h"
+#include "optimize.h"
+#include "parse.h"
+#include "resolve.h"
+#include "type_cache.h"
+#include "type_infer.h"
+
+using namespace std;
+
+// A module is a file M.bsl that others bring in with `import M`. It exports
+// the names its own top-level bindings bind, and the data types it can see;
+// its body is only run when it is compiled as the main program.
+//
+// Modules are compiled one at a time. Compiling M.bsl leaves its C in
+// M.bsl.c, its object in M.bsl.o and its interface in M.bsl.bsli: the data
+// types and the schemes of the values it exports. The interface starts with
+// a hash of the source, of the options gcc is given with the runtime header
+// they find, and of the interface of each module M imports, so that a
+// module whose source, options and imports did not change is not lexed,
+// parsed, inferred or handed to gcc again, and a change that leaves an
+// interface as it was does not reach the modules that import it.
+struct Module {
+  string name, path;
+  // the interface after its header, which is all a unit importing the
+  // module reads, and its hash
+  string interface;
+  uint64_t hash;
+};
+
+struct Modules {
+  static const uint8_t VERSION = 2;
+  vector<string> include_path;
+  string more;
+  // the hash of more, the include path and the bsl_rt.h it finds
+  uint64_t options;
+  bool c_only;
+  size_t threads;
+  TypeCache *cache;
+  map<string, Module> built;
+  set<string> building;
+  // the modules built, each after the ones it imports
+  vector<string> order;
+  Modules(const vector<string> &include_path, const string &more, bool c_only,
+          size_t threads, TypeCache *cache)
+      : include_path(include_path),
+        more(more),
+        c_only(c_only),
+        threads(threads),
+        cache(cache) {
+    TypeWriter w;
+    w.str(more);
+    w.u32(include_path.size());
+    for (auto &ip : include_path) {
+      w.str(ip);
+    }
+    for (auto &ip : include_path) {
+      string rt;
+      if (read(ip + "/bsl_rt.h", rt)) {
+        w.str(rt);
+        break;
+      }
+    }
+    options = TypeCache::hash(w.out);
+  }
+
+  [[noreturn]] void fail(const Position &pos, const string &message,
+                         string data) {
+    if (data.length() > 78) {
+      data = data.substr(0, 75) + "...";
+    }
+    cerr << "module: " << to_string(pos) << " " << message << endl
+         << "`" << data << "`" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static string directory_of(const string &path) {
+    auto i = path.rfind('/');
+    return i == string::npos ? "." : path.substr(0, i);
+  }
+  static bool exists(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+  }
+  static bool read(const string &path, string &data) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+      return false;
+    }
+    stringstream s;
+    s << in.rdbuf();
+    data = s.str();
+    return true;
+  }
+  // Looks for name.bsl next to the unit that imports it, then on the include
+  // path.
+  string find(const string &name, const string &directory) {
+    if (exists(directory + "/" + name + ".bsl")) {
+      return directory + "/" + name + ".bsl";
+    }
+    for (auto &ip : include_path) {
+      if (exists(ip + "/" + name + ".bsl")) {
+        return ip + "/" + name + ".bsl";
+      }
+    }
+    return "";
+  }
+  string object(const Module &m) { return m.path + (c_only ? ".c" : ".o"); }
+
+  // Brings the modules unit imports up to date, then adds their data types
+  // and constructors to unit and the schemes of their values to its imports.
+  void import(shared_ptr<Unit> unit, const string &directory) {
+    for (auto &i : unit->imports) {
+      build(i, directory);
+    }
+    for (auto &i : unit->imports) {
+      load(unit, i);
+    }
+  }
+
+  const Module &build(const Import &i, const string &directory) {
+    auto path = find(i.module, directory);
+    if (path.empty()) {
+      fail(i.pos, "module not found", i.module);
+    }
+    if (built.count(i.module)) {
+      if (built[i.module].path != path) {
+        fail(i.pos, "module names conflict with " + built[i.module].path,
+             i.module);
+      }
+      return built[i.module];
+    }
+    if (building.count(i.module)) {
+      fail(i.pos, "modules import each other", i.module);
+    }
+    building.insert(i.module);
+    Module m;
+    m.name = i.module;
+    m.path = path;
+    if (!up_to_date(m)) {
+      compile(m);
+    }
+    building.erase(i.module);
+    order.push_back(m.name);
+    return built[m.name] = m;
+  }
+
+  // Whether the interface of m was written for its source as it is and for
+  // the interfaces of its imports as they are, which are brought up to date
+  // first. Anything amiss makes m compiled again, which reports it if it is
+  // an error.
+  bool up_to_date(Module &m) {
+    string data, text;
+    if (!read(m.path + ".bsli", data) || !read(m.path, text) ||
+        !exists(object(m)) || data.size() < 5 || data.substr(0, 4) != "BSLI" ||
+        uint8_t(data[4]) != VERSION) {
+      return false;
+    }
+    TypeReader r(data, 5);
+    if (r.u64() != TypeCache::hash(text) || r.u64() != options) {
+      return false;
+    }
+    auto n = r.u32();
+    for (uint32_t j = 0; j < n && r.ok; j++) {
+      Import i;
+      i.module = r.str();
+      auto hash = r.u64();
+      auto path = find(i.module, directory_of(m.path));
+      if (!r.ok || path.empty() || building.count(i.module) ||
+          (built.count(i.module) && built[i.module].path != path) ||
+          build(i, directory_of(m.path)).hash != hash) {
+        return false;
+      }
+    }
+    if (!r.ok) {
+      return false;
+    }
+    m.interface = data.substr(r.pos);
+    m.hash = TypeCache::hash(m.interface);
+    return true;
+  }
+
+  void compile(Module &m) {
+    Lexer lexer(m.path);
+    Parser parser(lexer);
+    auto unit = parser.parse_imports();
+    unit->module = m.name;
+    import(unit, directory_of(m.path));
+    parser.parse();
+    bind(unit);
+    Resolver resolver(unit);
+    TypeInfer type_infer(unit, threads, cache);
+
+    TypeWriter w;
+    w.u32(unit->data.size());
+    for (auto &dai : unit->data) {
+      auto da = dai.second;
+      w.str(da->module.empty() ? m.name : da->module);
+      w.str(da->name);
+      w.u32(da->arg);
+      w.u32(da->constructors.size());
+      for (auto &c : da->constructors) {
+        w.str(c->name);
+        w.type(c->sig);
+      }
+    }
+    w.u32(type_infer.exports.size());
+    for (auto &x : type_infer.exports) {
+      w.str(x.first);
+      w.type(x.second);
+      if (!w.closed) {
+        cerr << "module: " << x.first << " in " << m.path
+             << " has a type that cannot be exported" << endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    m.interface = w.out;
+    m.hash = TypeCache::hash(m.interface);
+    free_types();
+
+    {
+      ofstream csrc(m.path + ".c");
+      CodeGenerator code_generator(csrc, unit, make_shared<Optimizer>());
+    }
+    if (!c_only) {
+      stringstream gcc_cmd;
+      gcc_cmd << "gcc -c " << m.path << ".c";
+      for (auto &ip : include_path) {
+        gcc_cmd << " -I" << ip;
+      }
+      if (!more.empty()) {
+        gcc_cmd << " " << more;
+      }
+      gcc_cmd << " -o " << m.path << ".o";
+      if (int code = system(gcc_cmd.str().c_str())) {
+        exit(code);
+      }
+    }
+
+    // written last, so that a module that failed to compile is never taken
+    // to be up to date
+    auto &text = source(lexer.file);
+    TypeWriter h;
+    h.u64(TypeCache::hash(string(text.data, text.size)));
+    h.u64(options);
+    h.u32(unit->imports.size());
+    for (auto &i : unit->imports) {
+      h.str(i.module);
+      h.u64(built[i.module].hash);
+    }
+    ofstream out(m.path + ".bsli", ios::binary);
+    out << "BSLI" << char(VERSION) << h.out << m.interface;
+  }
+
+  // Reads the interface of the module i names into unit. A data type seen
+  // through more than one import is added once.
+  void load(shared_ptr<Unit> unit, Import &i) {
+    auto &m = built[i.module];
+    TypeReader r(m.interface);
+    auto n = r.u32();
+    for (uint32_t j = 0; j < n && r.ok; j++) {
+      auto da = make_shared<Data>();
+      da->module = r.str();
+      da->name = r.str();
+      da->arg = r.u32();
+      auto k = r.u32();
+      for (uint32_t l = 0; l < k && r.ok; l++) {
+        auto c = make_shared<Constructor>();
+        c->name = r.str();
+        c->sig = r.type();
+        c->data_name = da->name;
+        c->arg = 0;
+        if (r.ok) {
+          auto tm = get_mono(c->sig);
+          while (is_fun(tm)) {
+            c->arg++;
+            tm = tm->tau[1];
+          }
+        }
+        da->constructors.push_back(c);
+      }
+      if (!r.ok) {
+        break;
+      }
+      if (unit->data.count(da->name)) {
+        if (unit->data[da->name]->module != da->module) {
+          fail(i.pos, "type names conflict", da->name);
+        }
+        continue;
+      }
+      for (auto &c : da->constructors) {
+        if (unit->cons.count(c->name)) {
+          fail(i.pos, "constructor names conflict", c->name);
+        }
+        unit->cons[c->name] = c;
+      }
+      unit->data[da->name] = da;
+    }
+    n = r.u32();
+    for (uint32_t j = 0; j < n && r.ok; j++) {
+      auto x = r.str();
+      i.values.push_back(make_pair(x, r.type()));
+    }
+    if (!r.ok || r.pos != m.interface.size()) {
+      fail(i.pos, "interface is damaged: delete " + m.path + ".bsli", i.module);
+    }
+  }
+
+  // Binds the values of the imports around the top-level bindings of unit,
+  // each to the global its module stores it in, and records what unit
+  // exports if it is a module.
+  void bind(shared_ptr<Unit> unit) {
+    if (!unit->module.empty()) {
+      for (auto e = unit->expr; e->sig == nullptr && (e->T == ExprType::LET ||
+                                                      e->T == ExprType::REC);
+           e = e->T == ExprType::LET ? e->as<Let>()->e2 : e->as<Rec>()->e) {
+        for (auto &x : TypeCache::names(e)) {
+          unit->exports.insert(x);
+        }
+      }
+    }
+    for (auto i = unit->imports.rbegin(); i != unit->imports.rend(); i++) {
+      for (auto v = i->values.rbegin(); v != i->values.rend(); v++) {
+        auto &arena = unit->arena;
+        auto e = arena.make<Let>();
+        e->pos = i->pos;
+        e->x = arena.copy(v->first);
+        auto f = arena.make<Ffi>();
+        f->source = arena.copy(
+            " " + CodeGenerator::exported(i->module, v->first) + " ");
+        f->sig = v->second;
+        e->e1 = f;
+        e->e2 = unit->expr;
+        unit->expr = e;
+      }
+    }
+  }
+};
+
+#endif
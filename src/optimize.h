@@ -1,14 +1,842 @@
 #ifndef SU_BOLEYN_BSL_OPTIMIZE_H
 #define SU_BOLEYN_BSL_OPTIMIZE_H
 
-#include <memory>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "ds/expr.h"
+#include "ds/string_view.h"
+#include "ds/unit.h"
 
 using namespace std;
 
+// Simplifies the expression the code generator is about to compile, which
+// has been type checked, by inlining small functions bound by `let` where
+// they are called, reducing the applications of lambdas this exposes to
+// `let`s, and dropping the bindings nothing uses any more.
+//
+// A `case` on a constructor it can see is reduced to the branch that matches,
+// with the fields bound by `let`s, and a `case` on the result of another one
+// is moved into the branches of that one. To see them, the functions that
+// build the constructors are only inlined once nothing else changes.
+//
+// Variables are matched by name, as the code generator does, so the binders
+// are first renamed to be distinct from one another, and every copy of a
+// lambda gets fresh ones: an expression moved under a binder can then never
+// be captured by it. Slots are not kept up to date. An ffi block may take the
+// address of a variable it uses, or assign it, so such a variable is never
+// replaced in it, its binding is kept, and no other variable is replaced by
+// it; one that an ffi block may write is not replaced at all. A lambda is
+// not inlined if its ffi blocks name a variable it captures and an ffi
+// block may write.
 struct Optimizer {
-  shared_ptr<Expr> optimize(shared_ptr<Expr> e) { return e; }
+  // the largest lambda, in nodes, that is copied to more than one call
+  static const size_t INLINE_SIZE = 40;
+  static const size_t MAX_PASSES = 8;
+
+  struct Use {
+    // the times a name is called, is used otherwise, and is used in the
+    // bindings of the rec that binds it
+    uint32_t calls = 0, others = 0, inner = 0;
+    // the times it is matched by a `case`
+    uint32_t cases = 0;
+    // whether an ffi block names it, and whether one may write it
+    bool ffi = false, written = false;
+  };
+  // A variable known to hold constructor c with the fields in xs.
+  struct Known {
+    StringView c;
+    vector<StringView> xs;
+  };
+
+  ExprArena *arena;
+  // the arity of each constructor, and whether the functions that build them
+  // may be inlined yet
+  map<StringView, size_t> cons;
+  bool lower;
+  // every name in the expression, and the name each fresh one was made from
+  set<StringView> names;
+  map<StringView, StringView> origin;
+  uint32_t fresh_names = 0;
+  map<StringView, vector<StringView>> scope;
+  map<StringView, Use> uses;
+  // the variables and lambdas bound by the `let`s being inlined
+  map<StringView, Expr *> subst;
+  map<StringView, Known> known;
+  bool changed;
+
+  // Constructors are bound, outside everything else, to variables named after
+  // them, which keep their names when the binders are renamed.
+  Expr *optimize(Expr *e, Unit &unit) {
+    arena = &unit.arena;
+    for (auto &c : unit.cons) {
+      cons[StringView(c.first.data(), c.first.size())] = c.second->arg;
+    }
+    collect(e);
+    set<StringView> bound;
+    e = rename(e, &bound);
+    for (int phase = 0; phase < 2; phase++) {
+      lower = phase == 1;
+      for (size_t i = 0; i < MAX_PASSES; i++) {
+        uses.clear();
+        count(e);
+        changed = false;
+        e = simplify(e);
+        if (!changed) {
+          break;
+        }
+      }
+    }
+    return e;
+  }
+
+  // Calls f on each variable written as $x in an ffi block, in order.
+  template <typename F>
+  static void ffi_vars(StringView source, F f) {
+    for (size_t i = 0; i < source.size(); i++) {
+      if (source[i] == '$' && i + 1 < source.size()) {
+        size_t begin = ++i;
+        while (i < source.size() &&
+               (('0' <= source[i] && source[i] <= '9' && i > begin) ||
+                ('A' <= source[i] && source[i] <= 'Z') ||
+                ('a' <= source[i] && source[i] <= 'z') || source[i] == '_' ||
+                (source[i] == '\'' && i > begin))) {
+          i++;
+        }
+        if (i > begin) {
+          f(begin, i);
+        }
+        i--;
+      }
+    }
+  }
+  // Whether the variable in [begin, end) of the ffi block s, just after
+  // its $, may be assigned there or have its address taken.
+  static bool writes(StringView s, size_t begin, size_t end) {
+    auto blank = [](char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    };
+    size_t i = begin - 1;
+    while (i > 0 && blank(s[i - 1])) {
+      i--;
+    }
+    if (i > 0 && s[i - 1] == '&' && (i < 2 || s[i - 2] != '&')) {
+      return true;
+    }
+    if (i > 1 && s[i - 1] == s[i - 2] && (s[i - 1] == '+' || s[i - 1] == '-')) {
+      return true;
+    }
+    size_t j = end;
+    while (j < s.size() && blank(s[j])) {
+      j++;
+    }
+    auto at = [&](size_t k) { return k < s.size() ? s[k] : '\0'; };
+    if (at(j) == '=') {
+      return at(j + 1) != '=';
+    }
+    if (at(j) == at(j + 1) && (at(j) == '+' || at(j) == '-')) {
+      return true;
+    }
+    if (at(j + 1) == '=' && at(j) != '\0' && strchr("+-*/%&|^", at(j))) {
+      return true;
+    }
+    return at(j) == at(j + 1) && (at(j) == '<' || at(j) == '>') &&
+           at(j + 2) == '=';
+  }
+  // Writes the ffi block e again with each variable x as to(x).
+  template <typename F>
+  Expr *rewrite_ffi(Ffi *e, F to) {
+    string source;
+    vector<StringView> vars;
+    size_t last = 0;
+    ffi_vars(e->source, [&](size_t begin, size_t end) {
+      auto x = to(e->source.substr(begin, end - begin));
+      source.append(e->source.data() + last, begin - last);
+      source.append(x.data(), x.size());
+      vars.push_back(x);
+      last = end;
+    });
+    source.append(e->source.data() + last, e->source.size() - last);
+    auto f = arena->make<Ffi>();
+    f->sig = e->sig;
+    f->source = arena->copy(source);
+    f->vars = arena->array(vars);
+    f->slots = arena->array(vector<uint32_t>(vars.size(), NO_SLOT));
+    return f;
+  }
+
+  void collect(Expr *e) {
+    switch (e->T) {
+      case ExprType::VAR:
+        names.insert(e->as<Var>()->x);
+        break;
+      case ExprType::APP:
+        collect(e->as<App>()->e1);
+        collect(e->as<App>()->e2);
+        break;
+      case ExprType::ABS:
+        names.insert(e->as<Abs>()->x);
+        collect(e->as<Abs>()->e);
+        break;
+      case ExprType::LET:
+        names.insert(e->as<Let>()->x);
+        collect(e->as<Let>()->e1);
+        collect(e->as<Let>()->e2);
+        break;
+      case ExprType::REC:
+        for (auto &xe : e->as<Rec>()->xes) {
+          names.insert(xe.x);
+          collect(xe.e);
+        }
+        collect(e->as<Rec>()->e);
+        break;
+      case ExprType::CASE:
+        collect(e->as<Case>()->e);
+        for (auto &pes : e->as<Case>()->pes) {
+          for (auto &x : pes.xs) {
+            names.insert(x);
+          }
+          collect(pes.e);
+        }
+        break;
+      case ExprType::FFI: {
+        auto source = e->as<Ffi>()->source;
+        ffi_vars(source, [&](size_t begin, size_t end) {
+          names.insert(source.substr(begin, end - begin));
+        });
+      } break;
+    }
+  }
+
+  // A name no variable has, made from x.
+  StringView fresh(StringView x) {
+    if (origin.count(x)) {
+      x = origin[x];
+    }
+    for (;;) {
+      auto y = arena->copy(x.str() + "'" + to_string(++fresh_names));
+      if (names.insert(y).second) {
+        origin[y] = x;
+        return y;
+      }
+    }
+  }
+  // Binds x, under a fresh name unless bound is given and x has not been
+  // bound before.
+  StringView bind(StringView x, set<StringView> *bound) {
+    auto y = bound != nullptr && bound->insert(x).second ? x : fresh(x);
+    scope[x].push_back(y);
+    return y;
+  }
+  void unbind(StringView x) {
+    auto it = scope.find(x);
+    it->second.pop_back();
+    if (it->second.empty()) {
+      scope.erase(it);
+    }
+  }
+  StringView lookup(StringView x) {
+    auto it = scope.find(x);
+    return it != scope.end() ? it->second.back() : x;
+  }
+
+  // Copies e with the binders renamed: those in bound already, or all of
+  // them if bound is null.
+  Expr *rename(Expr *e, set<StringView> *bound) {
+    switch (e->T) {
+      case ExprType::VAR: {
+        auto v = arena->make<Var>();
+        *v = *e->as<Var>();
+        v->x = lookup(v->x);
+        return v;
+      }
+      case ExprType::APP: {
+        auto a = arena->make<App>();
+        *a = *e->as<App>();
+        a->e1 = rename(a->e1, bound);
+        a->e2 = rename(a->e2, bound);
+        return a;
+      }
+      case ExprType::ABS: {
+        auto a = arena->make<Abs>();
+        *a = *e->as<Abs>();
+        auto x = a->x;
+        a->x = bind(x, bound);
+        a->e = rename(a->e, bound);
+        unbind(x);
+        return a;
+      }
+      case ExprType::LET: {
+        auto l = arena->make<Let>();
+        *l = *e->as<Let>();
+        auto x = l->x;
+        l->e1 = rename(l->e1, bound);
+        l->x = bind(x, bound);
+        l->e2 = rename(l->e2, bound);
+        unbind(x);
+        return l;
+      }
+      case ExprType::REC: {
+        auto r = arena->make<Rec>();
+        *r = *e->as<Rec>();
+        vector<Binding> xes(r->xes.begin(), r->xes.end());
+        for (auto &xe : xes) {
+          xe.x = bind(xe.x, bound);
+        }
+        for (auto &xe : xes) {
+          xe.e = rename(xe.e, bound);
+        }
+        r->e = rename(r->e, bound);
+        for (auto &xe : r->xes) {
+          unbind(xe.x);
+        }
+        // the new names may sort in another order
+        sort(xes.begin(), xes.end(),
+             [](const Binding &a, const Binding &b) { return a.x < b.x; });
+        r->xes = arena->array(xes);
+        return r;
+      }
+      case ExprType::CASE: {
+        auto c = arena->make<Case>();
+        *c = *e->as<Case>();
+        c->e = rename(c->e, bound);
+        vector<Branch> pes(c->pes.begin(), c->pes.end());
+        for (auto &pe : pes) {
+          vector<StringView> xs;
+          for (auto x : pe.xs) {
+            xs.push_back(bind(x, bound));
+          }
+          pe.e = rename(pe.e, bound);
+          for (auto x : pe.xs) {
+            unbind(x);
+          }
+          pe.xs = arena->array(xs);
+        }
+        c->pes = arena->array(pes);
+        return c;
+      }
+      case ExprType::FFI:
+        return rewrite_ffi(e->as<Ffi>(),
+                           [&](StringView x) { return lookup(x); });
+    }
+    return e;
+  }
+
+  void count(Expr *e) {
+    switch (e->T) {
+      case ExprType::VAR:
+        uses[e->as<Var>()->x].others++;
+        break;
+      case ExprType::APP: {
+        auto a = e->as<App>();
+        if (a->e1->T == ExprType::VAR) {
+          uses[a->e1->as<Var>()->x].calls++;
+        } else {
+          count(a->e1);
+        }
+        count(a->e2);
+      } break;
+      case ExprType::ABS:
+        uses[e->as<Abs>()->x];
+        count(e->as<Abs>()->e);
+        break;
+      case ExprType::LET:
+        uses[e->as<Let>()->x];
+        count(e->as<Let>()->e1);
+        count(e->as<Let>()->e2);
+        break;
+      case ExprType::REC: {
+        auto r = e->as<Rec>();
+        vector<uint32_t> before;
+        for (auto &xe : r->xes) {
+          auto &u = uses[xe.x];
+          before.push_back(u.calls + u.others);
+        }
+        for (auto &xe : r->xes) {
+          count(xe.e);
+        }
+        for (size_t i = 0; i < r->xes.size(); i++) {
+          auto &u = uses[r->xes[i].x];
+          u.inner = u.calls + u.others - before[i];
+        }
+        count(r->e);
+      } break;
+      case ExprType::CASE:
+        if (e->as<Case>()->e->T == ExprType::VAR) {
+          uses[e->as<Case>()->e->as<Var>()->x].cases++;
+        }
+        count(e->as<Case>()->e);
+        for (auto &pes : e->as<Case>()->pes) {
+          for (auto &x : pes.xs) {
+            uses[x];
+          }
+          count(pes.e);
+        }
+        break;
+      case ExprType::FFI: {
+        auto source = e->as<Ffi>()->source;
+        ffi_vars(source, [&](size_t begin, size_t end) {
+          auto &u = uses[source.substr(begin, end - begin)];
+          u.ffi = true;
+          u.written = u.written || writes(source, begin, end);
+        });
+      } break;
+    }
+  }
+
+  // The number of nodes in e, or a number over limit if there are more.
+  static size_t size(Expr *e, size_t limit) {
+    size_t n = 0;
+    vector<Expr *> stack{e};
+    while (!stack.empty() && n <= limit) {
+      e = stack.back();
+      stack.pop_back();
+      n++;
+      switch (e->T) {
+        case ExprType::VAR:
+        case ExprType::FFI:
+          break;
+        case ExprType::APP:
+          stack.push_back(e->as<App>()->e1);
+          stack.push_back(e->as<App>()->e2);
+          break;
+        case ExprType::ABS:
+          stack.push_back(e->as<Abs>()->e);
+          break;
+        case ExprType::LET:
+          stack.push_back(e->as<Let>()->e1);
+          stack.push_back(e->as<Let>()->e2);
+          break;
+        case ExprType::REC:
+          for (auto &xe : e->as<Rec>()->xes) {
+            stack.push_back(xe.e);
+          }
+          stack.push_back(e->as<Rec>()->e);
+          break;
+        case ExprType::CASE:
+          stack.push_back(e->as<Case>()->e);
+          for (auto &pes : e->as<Case>()->pes) {
+            stack.push_back(pes.e);
+          }
+          break;
+      }
+    }
+    return n;
+  }
+
+  // Whether e applies a constructor to all of its fields, and if so, its
+  // name and the applications that pass the fields, in order.
+  bool constructor(Expr *e, StringView *c, vector<App *> *fields) {
+    fields->clear();
+    while (e->T == ExprType::APP) {
+      fields->push_back(e->as<App>());
+      e = e->as<App>()->e1;
+    }
+    if (e->T != ExprType::VAR) {
+      return false;
+    }
+    auto it = cons.find(e->as<Var>()->x);
+    if (it == cons.end() || it->second != fields->size()) {
+      return false;
+    }
+    reverse(fields->begin(), fields->end());
+    *c = it->first;
+    return true;
+  }
+  // Whether e only allocates: it cannot fail, loop or have any effect.
+  bool value(Expr *e) {
+    StringView c;
+    vector<App *> fields;
+    if (e->T == ExprType::VAR || e->T == ExprType::ABS) {
+      return true;
+    }
+    if (!constructor(e, &c, &fields)) {
+      return false;
+    }
+    for (auto a : fields) {
+      if (a->e2->T != ExprType::VAR) {
+        return false;
+      }
+    }
+    return true;
+  }
+  Var *var(StringView x) {
+    auto v = arena->make<Var>();
+    v->x = x;
+    return v;
+  }
+  Let *let(StringView x, Expr *e1, Expr *e2) {
+    auto l = arena->make<Let>();
+    l->x = x;
+    l->e1 = e1;
+    l->e2 = e2;
+    return l;
+  }
+  // Calls f while x is known to hold c with the fields in xs, unless an ffi
+  // block names x or one of them, and so may change what x holds.
+  template <typename F>
+  void assume(StringView x, StringView c, vector<StringView> xs, F f) {
+    if (in_ffi(x) ||
+        any_of(xs.begin(), xs.end(), [&](StringView y) { return in_ffi(y); })) {
+      f();
+      return;
+    }
+    auto it = known.find(x);
+    bool had = it != known.end();
+    Known old;
+    if (had) {
+      old = it->second;
+    }
+    known[x] = Known{c, move(xs)};
+    f();
+    if (had) {
+      known[x] = old;
+    } else {
+      known.erase(x);
+    }
+  }
+  // Calls f while x is known to hold what e1 builds, if that is a
+  // constructor with variables as its fields.
+  template <typename F>
+  void assume(StringView x, Expr *e1, F f) {
+    StringView c;
+    vector<App *> fields;
+    if (!value(e1) || !constructor(e1, &c, &fields)) {
+      f();
+      return;
+    }
+    vector<StringView> xs;
+    for (auto a : fields) {
+      xs.push_back(a->e2->as<Var>()->x);
+    }
+    assume(x, c, move(xs), f);
+  }
+  // Calls f on each branch of c, knowing in it which constructor the
+  // variable c matches holds.
+  template <typename F>
+  void branches(Case *c, F f) {
+    for (auto &pe : c->pes) {
+      if (c->e->T == ExprType::VAR) {
+        assume(c->e->as<Var>()->x, pe.c,
+               vector<StringView>(pe.xs.begin(), pe.xs.end()),
+               [&]() { f(pe); });
+      } else {
+        f(pe);
+      }
+    }
+  }
+
+  // Whether an ffi block names x, and so may write it.
+  bool in_ffi(StringView x) {
+    auto it = uses.find(x);
+    return it != uses.end() && it->second.ffi;
+  }
+  // Whether an ffi block in e names a variable bound outside e that an ffi
+  // block may write. In a lambda that is inlined, it would then use that
+  // variable itself, rather than the copy the closure holds.
+  bool ffi_outside(Expr *e) {
+    set<StringView> bound, named;
+    vector<Expr *> stack{e};
+    while (!stack.empty()) {
+      e = stack.back();
+      stack.pop_back();
+      switch (e->T) {
+        case ExprType::VAR:
+          break;
+        case ExprType::APP:
+          stack.push_back(e->as<App>()->e1);
+          stack.push_back(e->as<App>()->e2);
+          break;
+        case ExprType::ABS:
+          bound.insert(e->as<Abs>()->x);
+          stack.push_back(e->as<Abs>()->e);
+          break;
+        case ExprType::LET:
+          bound.insert(e->as<Let>()->x);
+          stack.push_back(e->as<Let>()->e1);
+          stack.push_back(e->as<Let>()->e2);
+          break;
+        case ExprType::REC:
+          for (auto &xe : e->as<Rec>()->xes) {
+            bound.insert(xe.x);
+            stack.push_back(xe.e);
+          }
+          stack.push_back(e->as<Rec>()->e);
+          break;
+        case ExprType::CASE:
+          stack.push_back(e->as<Case>()->e);
+          for (auto &pe : e->as<Case>()->pes) {
+            bound.insert(pe.xs.begin(), pe.xs.end());
+            stack.push_back(pe.e);
+          }
+          break;
+        case ExprType::FFI: {
+          auto source = e->as<Ffi>()->source;
+          ffi_vars(source, [&](size_t begin, size_t end) {
+            named.insert(source.substr(begin, end - begin));
+          });
+        } break;
+      }
+    }
+    for (auto x : named) {
+      if (!bound.count(x) && uses[x].written) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Reduces the application a of a lambda to a `let`, and moves a `let` or
+  // a `rec` out of the function a applies, which no variable in the argument
+  // can refer to. A lambda whose ffi blocks name a variable bound outside it
+  // is left to be called.
+  Expr *beta(App *a) {
+    switch (a->e1->T) {
+      case ExprType::ABS: {
+        auto f = a->e1->as<Abs>();
+        if (ffi_outside(f)) {
+          return a;
+        }
+        auto l = arena->make<Let>();
+        l->pos = f->pos;
+        l->x = f->x;
+        l->e1 = a->e2;
+        l->e2 = f->e;
+        changed = true;
+        return l;
+      }
+      case ExprType::LET: {
+        auto l = a->e1->as<Let>();
+        a->e1 = l->e2;
+        l->e2 = beta(a);
+        changed = true;
+        return l;
+      }
+      case ExprType::REC: {
+        auto r = a->e1->as<Rec>();
+        a->e1 = r->e;
+        r->e = beta(a);
+        changed = true;
+        return r;
+      }
+      default:
+        return a;
+    }
+  }
+
+  Expr *simplify(Expr *e) {
+    switch (e->T) {
+      case ExprType::VAR: {
+        auto it = subst.find(e->as<Var>()->x);
+        if (it != subst.end() && it->second->T == ExprType::VAR) {
+          changed = true;
+          auto v = arena->make<Var>();
+          *v = *it->second->as<Var>();
+          return v;
+        }
+        return e;
+      }
+      case ExprType::APP: {
+        auto a = e->as<App>();
+        auto it = a->e1->T == ExprType::VAR ? subst.find(a->e1->as<Var>()->x)
+                                            : subst.end();
+        if (it != subst.end() && it->second->T == ExprType::ABS) {
+          changed = true;
+          a->e1 = rename(it->second, nullptr);
+        } else {
+          a->e1 = simplify(a->e1);
+        }
+        a->e2 = simplify(a->e2);
+        return beta(a);
+      }
+      case ExprType::ABS:
+        e->as<Abs>()->e = simplify(e->as<Abs>()->e);
+        return e;
+      case ExprType::LET: {
+        auto l = e->as<Let>();
+        l->e1 = simplify(l->e1);
+        // the `let`s and `rec`s around what l binds are moved out of it, and
+        // put back around what l becomes
+        vector<Expr *> outer;
+        for (;;) {
+          if (l->e1->T == ExprType::LET) {
+            outer.push_back(l->e1);
+            l->e1 = l->e1->as<Let>()->e2;
+          } else if (l->e1->T == ExprType::REC) {
+            outer.push_back(l->e1);
+            l->e1 = l->e1->as<Rec>()->e;
+          } else {
+            break;
+          }
+          changed = true;
+        }
+        auto r = simplify_let(l);
+        for (size_t i = outer.size(); i-- > 0;) {
+          if (outer[i]->T == ExprType::LET) {
+            outer[i]->as<Let>()->e2 = r;
+          } else {
+            outer[i]->as<Rec>()->e = r;
+          }
+          r = outer[i];
+        }
+        return r;
+      }
+      case ExprType::REC: {
+        auto r = e->as<Rec>();
+        for (auto &xe : r->xes) {
+          xe.e = simplify(xe.e);
+        }
+        r->e = simplify(r->e);
+        for (auto &xe : r->xes) {
+          auto it = uses.find(xe.x);
+          if (it == uses.end() || it->second.ffi ||
+              it->second.calls + it->second.others != it->second.inner) {
+            return r;
+          }
+        }
+        changed = true;
+        return r->e;
+      }
+      case ExprType::CASE: {
+        auto c = e->as<Case>();
+        c->e = simplify(c->e);
+        return match(c);
+      }
+      case ExprType::FFI:
+        return e;
+    }
+    return e;
+  }
+  // Simplifies the `let` l, whose bound expression is simplified already.
+  Expr *simplify_let(Let *l) {
+    auto it = uses.find(l->x);
+    if (it == uses.end()) {
+      l->e2 = simplify(l->e2);
+      return l;
+    }
+    auto u = it->second;
+    if (value(l->e1) && u.calls == 0 && u.others == 0 && !u.ffi) {
+      changed = true;
+      return simplify(l->e2);
+    }
+    // a variable an ffi block names may be written after l copies it, and
+    // one an ffi block writes may no longer hold what l binds it to
+    if (!u.written &&
+        ((l->e1->T == ExprType::VAR && !in_ffi(l->e1->as<Var>()->x)) ||
+         (l->e1->T == ExprType::ABS && u.calls != 0 &&
+          (lower || !cons.count(l->x)) && !ffi_outside(l->e1) &&
+          ((u.calls == 1 && u.others == 0 && !u.ffi) ||
+           size(l->e1, INLINE_SIZE) <= INLINE_SIZE)))) {
+      subst[l->x] = l->e1;
+      auto e2 = simplify(l->e2);
+      subst.erase(l->x);
+      if ((l->e1->T == ExprType::VAR || u.others == 0) && !u.ffi) {
+        changed = true;
+        return e2;
+      }
+      l->e2 = e2;
+      return l;
+    }
+    // the fields of a constructor that is matched get names, so that
+    // the matches can refer to them
+    StringView c;
+    vector<App *> fields;
+    vector<Let *> lets;
+    if (u.cases != 0 && constructor(l->e1, &c, &fields)) {
+      for (auto a : fields) {
+        if (a->e2->T != ExprType::VAR) {
+          auto x = fresh(l->x);
+          lets.push_back(let(x, a->e2, nullptr));
+          a->e2 = var(x);
+        }
+      }
+    }
+    assume(l->x, l->e1, [&]() { l->e2 = simplify(l->e2); });
+    Expr *r = l;
+    for (size_t i = lets.size(); i-- > 0;) {
+      changed = true;
+      lets[i]->e2 = r;
+      r = lets[i];
+    }
+    return r;
+  }
+  // Simplifies the `case` c, whose scrutinee is simplified already.
+  Expr *match(Case *c) {
+    switch (c->e->T) {
+      case ExprType::LET: {
+        auto l = c->e->as<Let>();
+        c->e = l->e2;
+        assume(l->x, l->e1, [&]() { l->e2 = match(c); });
+        changed = true;
+        return l;
+      }
+      case ExprType::REC: {
+        auto r = c->e->as<Rec>();
+        c->e = r->e;
+        r->e = match(c);
+        changed = true;
+        return r;
+      }
+      case ExprType::CASE: {
+        auto in = c->e->as<Case>();
+        size_t n = 0;
+        for (auto &pe : c->pes) {
+          n += size(pe.e, INLINE_SIZE);
+        }
+        if (in->pes.size() != 1 && n > INLINE_SIZE) {
+          break;
+        }
+        // every branch of in but one gets a copy of c with fresh binders
+        c->e = var(StringView());
+        vector<Case *> outs{c};
+        for (size_t i = 1; i < in->pes.size(); i++) {
+          outs.push_back(rename(c, nullptr)->as<Case>());
+        }
+        size_t i = 0;
+        branches(in, [&](Branch &pe) {
+          outs[i]->e = pe.e;
+          pe.e = match(outs[i++]);
+        });
+        changed = true;
+        return in;
+      }
+      default:
+        break;
+    }
+    StringView k;
+    vector<App *> apps;
+    vector<Expr *> fields;
+    if (constructor(c->e, &k, &apps)) {
+      for (auto a : apps) {
+        fields.push_back(a->e2);
+      }
+    } else if (c->e->T == ExprType::VAR && known.count(c->e->as<Var>()->x) &&
+               !in_ffi(c->e->as<Var>()->x)) {
+      auto &x = known[c->e->as<Var>()->x];
+      k = x.c;
+      for (auto y : x.xs) {
+        fields.push_back(var(y));
+      }
+    }
+    auto pe = k.empty() ? nullptr : c->find(k);
+    if (pe != nullptr && pe->xs.size() == fields.size()) {
+      changed = true;
+      Expr *r = simplify(pe->e);
+      for (size_t i = fields.size(); i-- > 0;) {
+        r = let(pe->xs[i], fields[i], r);
+      }
+      return r;
+    }
+    branches(c, [&](Branch &pe) { pe.e = simplify(pe.e); });
+    return c;
+  }
 };
 
 #endif
@@ -14,7 +14,6 @@
 
 #include "ds/data.h"
 #include "ds/expr.h"
-#include "ds/ffi.h"
 #include "ds/position.h"
 #include "ds/type.h"
 #include "ds/unit.h"
@@ -29,13 +28,8 @@ struct Parser {
   Parser(Lexer &lexer) : lexer(lexer) {}
 
   bool match(TokenType token_type) {
-    while (lexer.look_at(0).token_type == TokenType::HASHBANG ||
-           lexer.look_at(0).token_type == TokenType::SPACE ||
-           lexer.look_at(0).token_type == TokenType::COMMENT) {
-      lexer.next();
-    }
     t = lexer.look_at(0);
-    return lexer.look_at(0).token_type == token_type;
+    return t.token_type == token_type;
   }
 
   bool accept(TokenType token_type) {
@@ -60,19 +54,19 @@ struct Parser {
     }
   }
 
-  shared_ptr<Mono> parse_monotype(map<string, shared_ptr<Mono>> &m) {
+  Ref<Mono> parse_monotype(map<string, Ref<Mono>> &m) {
     auto mo = parse_monotype_(m);
     if (accept(TokenType::RIGHTARROW)) {
       auto t = new_fun();
       t->tau.push_back(mo);
       t->tau.push_back(parse_monotype(m));
-      mo = t;
+      mo = hash_cons(t);
     }
     return mo;
   }
 
-  shared_ptr<Mono> parse_monotype_(map<string, shared_ptr<Mono>> &m) {
-    shared_ptr<Mono> mo;
+  Ref<Mono> parse_monotype_(map<string, Ref<Mono>> &m) {
+    Ref<Mono> mo;
     if (accept(TokenType::IDENTIFIER)) {
       if (m.count(t.data)) {
         mo = m[t.data];
@@ -91,13 +85,21 @@ struct Parser {
     }
     if (is_c(mo) && !is_p(mo) && !is_fun(mo)) {
       auto t1 = mo;
+      if (mo->is_ground && (match(TokenType::IDENTIFIER) ||
+                            match(TokenType::LEFT_PARENTHESIS))) {
+        // a shared ground type must not be extended in place
+        t1 = new_const(mo->D.D, mo->kind);
+        for (auto a : mo->tau) {
+          t1->tau.push_back(a);
+        }
+      }
       while (match(TokenType::IDENTIFIER) ||
              match(TokenType::LEFT_PARENTHESIS)) {
         if (accept(TokenType::IDENTIFIER)) {
           if (m.count(t.data)) {
             mo = m[t.data];
           } else {
-            mo = new_const(t.data, new_kind());
+            mo = hash_cons(new_const(t.data, new_kind()));
           }
         } else {
           expect(TokenType::LEFT_PARENTHESIS);
@@ -116,7 +118,7 @@ struct Parser {
           if (m.count(t.data)) {
             mo = m[t.data];
           } else {
-            mo = new_const(t.data, new_kind());
+            mo = hash_cons(new_const(t.data, new_kind()));
           }
         } else {
           expect(TokenType::LEFT_PARENTHESIS);
@@ -127,10 +129,10 @@ struct Parser {
       }
       mo = t1;
     }
-    return mo;
+    return hash_cons(mo);
   }
 
-  shared_ptr<Poly> parse_polytype(map<string, shared_ptr<Mono>> &m) {
+  Ref<Poly> parse_polytype(map<string, Ref<Mono>> &m) {
     if (accept(TokenType::FORALL)) {
       expect(TokenType::IDENTIFIER);
       if (m.count(t.data)) {
@@ -169,7 +171,7 @@ struct Parser {
     }
     c->name = t.data;
     expect(TokenType::COLON);
-    map<string, shared_ptr<Mono>> m;
+    map<string, Ref<Mono>> m;
     c->sig = parse_polytype(m);
     unit->cons[c->name] = c;
     auto tm = get_mono(c->sig);
@@ -225,116 +227,335 @@ struct Parser {
     return d;
   }
 
-  shared_ptr<Expr> parse_expr() {
-    auto expr = make_shared<Expr>();
-    if (accept(TokenType::LAMBDA)) {
-      expr->T = ExprType::ABS;
-      expect(TokenType::IDENTIFIER);
-      expr->x = t.data;
-      expect(TokenType::RIGHTARROW);
-      expr->e = parse_expr();
-    } else if (accept(TokenType::LET)) {
-      shared_ptr<Poly> s;
-      expr->T = ExprType::LET;
-      expect(TokenType::IDENTIFIER);
-      expr->x = t.data;
-      if (accept(TokenType::COLON)) {
-        map<string, shared_ptr<Mono>> m;
-        s = parse_polytype(m);
+  // What is left to do with an expression once it is parsed.
+  enum class FrameType {
+    ABS,          // it is the body of a lambda
+    LET_E1,       // it is bound by a let
+    LET_E2,       // it is the body of a let
+    REC_E,        // it is bound by a rec
+    REC_BODY,     // it is the body of a rec
+    APP,          // it is an argument, or the function, of an application
+    APP_LAST,     // it is a lambda, let or rec that ends an application
+    PARENTHESIS,  // it is in parentheses
+    CASE_E,       // it is the expression a case looks at
+    CASE_BRANCH   // it is the body of a branch of a case
+  };
+  struct Frame {
+    FrameType T;
+    Expr *expr;
+    // the variable a rec binds or the constructor a branch matches, and the
+    // signature of the variable
+    StringView x;
+    Ref<Poly> sig;
+    // the data type whose constructors a case matches
+    string data_name;
+    // the bindings of a rec or the branches of a case parsed so far, and
+    // their names
+    vector<Binding> xes;
+    vector<Branch> pes;
+    set<StringView> names;
+    Frame(FrameType T, Expr *expr, StringView x = StringView(),
+          Ref<Poly> sig = nullptr)
+        : T(T), expr(expr), x(x), sig(sig) {}
+  };
+
+  // Parses `x [: sig] =`, which starts a binding of a rec.
+  void parse_rec_binding(Frame &f) {
+    Ref<Poly> s;
+    expect(TokenType::IDENTIFIER);
+    if (!f.names.insert(t.data).second) {
+      string data = t.data;
+      if (data.length() > 78) {
+        data = data.substr(0, 75) + "...";
       }
-      expect(TokenType::EQUAL);
-      expr->e1 = parse_expr();
-      expr->e1->sig = s;
-      expect(TokenType::IN);
-      expr->e2 = parse_expr();
-    } else if (accept(TokenType::REC)) {
-      expr->T = ExprType::REC;
-      do {
-        shared_ptr<Poly> s;
-        expect(TokenType::IDENTIFIER);
-        if (expr->xes.count(t.data)) {
-          string data = t.data;
-          if (data.length() > 78) {
-            data = data.substr(0, 75) + "...";
-          }
-          cerr << "parser: " << to_string(t.position)
-               << " variable names conflict" << endl
-               << "`" << data << "`" << endl;
-          exit(EXIT_FAILURE);
-        }
-        string rname = t.data;
-        if (accept(TokenType::COLON)) {
-          map<string, shared_ptr<Mono>> m;
-          s = parse_polytype(m);
+      cerr << "parser: " << to_string(t.position) << " variable names conflict"
+           << endl
+           << "`" << data << "`" << endl;
+      exit(EXIT_FAILURE);
+    }
+    f.x = t.data;
+    if (accept(TokenType::COLON)) {
+      map<string, Ref<Mono>> m;
+      s = parse_polytype(m);
+    }
+    f.sig = s;
+    expect(TokenType::EQUAL);
+  }
+
+  // Parses `C x1 ... xn ->`, which starts a branch of a case.
+  void parse_branch(Frame &f) {
+    expect(TokenType::IDENTIFIER);
+    if (!unit->cons.count(t.data)) {
+      string data = t.data;
+      if (data.length() > 78) {
+        data = data.substr(0, 75) + "...";
+      }
+      cerr << "parser: " << to_string(t.position) << " constructor not found"
+           << endl
+           << "`" << data << "`" << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!f.names.insert(t.data).second) {
+      string data = t.data;
+      if (data.length() > 78) {
+        data = data.substr(0, 75) + "...";
+      }
+      cerr << "parser: " << to_string(t.position) << " constructors conflict"
+           << endl
+           << "`" << data << "`" << endl;
+      exit(EXIT_FAILURE);
+    }
+    Branch pes;
+    pes.c = t.data;
+    pes.slot = NO_SLOT;
+    pes.e = nullptr;
+    auto c = unit->cons[t.data];
+    if (f.data_name.empty()) {
+      f.data_name = c->data_name;
+    } else if (f.data_name != c->data_name) {
+      string data = t.data;
+      if (data.length() > 78) {
+        data = data.substr(0, 75) + "...";
+      }
+      cerr << "parser: " << to_string(t.position) << " constructor of "
+           << f.data_name << " expected, but found" << endl
+           << "`" << data << "`" << endl;
+      exit(EXIT_FAILURE);
+    }
+    vector<StringView> xs;
+    set<StringView> st;
+    for (size_t i = 0; i < c->arg; i++) {
+      expect(TokenType::IDENTIFIER);
+      if (!st.insert(t.data).second) {
+        string data = t.data;
+        if (data.length() > 78) {
+          data = data.substr(0, 75) + "...";
         }
-        expect(TokenType::EQUAL);
-        expr->xes[rname] = parse_expr();
-        expr->xes[rname]->sig = s;
-      } while (accept(TokenType::AND));
-      expect(TokenType::IN);
-      expr->e = parse_expr();
-    } else {
-      expr = parse_expr_();
-      if (match(TokenType::LAMBDA) || match(TokenType::LET) ||
-          match(TokenType::REC)) {
-        auto e1 = parse_expr();
-        auto e2 = make_shared<Expr>();
-        e2->T = ExprType::APP;
-        e2->e1 = expr;
-        e2->e2 = e1;
-        expr = e2;
+        cerr << "parser: " << to_string(t.position)
+             << " variable names conflict" << endl
+             << "`" << data << "`" << endl;
+        exit(EXIT_FAILURE);
       }
+      xs.push_back(t.data);
     }
-    return expr;
+    pes.xs = unit->arena.array(xs);
+    f.pes.push_back(pes);
+    expect(TokenType::RIGHTARROW);
   }
 
-  shared_ptr<Expr> parse_expr_() {
-    auto expr = parse_expr__();
-    while (match(TokenType::IDENTIFIER) || match(TokenType::LEFT_PARENTHESIS) ||
-           match(TokenType::CASE) || match(TokenType::FFI)) {
-      auto t1 = expr;
-      expr = parse_expr__();
-      auto t2 = make_shared<Expr>();
-      t2->T = ExprType::APP;
-      t2->e1 = t1;
-      t2->e2 = expr;
-      expr = t2;
+  bool match_arg() {
+    return match(TokenType::IDENTIFIER) || match(TokenType::LEFT_PARENTHESIS) ||
+           match(TokenType::CASE) || match(TokenType::FFI);
+  }
+
+  // Expressions nest in the frames on stack rather than in native calls, so
+  // that a long chain of lets, lambdas or applications parses in constant
+  // native stack depth. Each loop either starts the expression (or, if arg,
+  // the argument of an application) at the next token, or hands the one just
+  // parsed to the innermost frame.
+  Expr *parse_expr() {
+    auto &arena = unit->arena;
+    vector<Frame> stack;
+    Expr *expr = nullptr;
+    bool start = true, arg = false;
+    for (;;) {
+      if (start && !arg) {
+        if (accept(TokenType::LAMBDA)) {
+          auto e = arena.make<Abs>();
+          e->pos = t.position;
+          expect(TokenType::IDENTIFIER);
+          e->x = t.data;
+          expect(TokenType::RIGHTARROW);
+          stack.push_back({FrameType::ABS, e});
+        } else if (accept(TokenType::LET)) {
+          Ref<Poly> s;
+          auto e = arena.make<Let>();
+          e->pos = t.position;
+          expect(TokenType::IDENTIFIER);
+          e->x = t.data;
+          if (accept(TokenType::COLON)) {
+            map<string, Ref<Mono>> m;
+            s = parse_polytype(m);
+          }
+          expect(TokenType::EQUAL);
+          stack.push_back({FrameType::LET_E1, e, StringView(), s});
+        } else if (accept(TokenType::REC)) {
+          auto e = arena.make<Rec>();
+          e->pos = t.position;
+          stack.push_back({FrameType::REC_E, e});
+          parse_rec_binding(stack.back());
+        } else {
+          stack.push_back({FrameType::APP, nullptr});
+          arg = true;
+        }
+        continue;
+      }
+      if (start) {
+        if (accept(TokenType::IDENTIFIER)) {
+          auto e = arena.make<Var>();
+          e->x = t.data;
+          expr = e;
+          start = false;
+        } else if (accept(TokenType::LEFT_PARENTHESIS)) {
+          stack.push_back({FrameType::PARENTHESIS, nullptr});
+          arg = false;
+        } else if (accept(TokenType::CASE)) {
+          stack.push_back({FrameType::CASE_E, arena.make<Case>()});
+          arg = false;
+        } else {
+          expr = parse_ffi();
+          start = false;
+        }
+        continue;
+      }
+      if (stack.empty()) {
+        return expr;
+      }
+      auto &f = stack.back();
+      switch (f.T) {
+        case FrameType::ABS:
+          f.expr->as<Abs>()->e = expr;
+          expr = f.expr;
+          stack.pop_back();
+          break;
+        case FrameType::LET_E1:
+          f.expr->as<Let>()->e1 = expr;
+          expr->sig = f.sig;
+          expect(TokenType::IN);
+          f.T = FrameType::LET_E2;
+          start = true;
+          arg = false;
+          break;
+        case FrameType::LET_E2:
+          f.expr->as<Let>()->e2 = expr;
+          expr = f.expr;
+          stack.pop_back();
+          break;
+        case FrameType::REC_E:
+          f.xes.push_back({f.x, expr});
+          expr->sig = f.sig;
+          if (accept(TokenType::AND)) {
+            parse_rec_binding(f);
+          } else {
+            expect(TokenType::IN);
+            f.T = FrameType::REC_BODY;
+          }
+          start = true;
+          arg = false;
+          break;
+        case FrameType::REC_BODY: {
+          auto r = f.expr->as<Rec>();
+          sort(f.xes.begin(), f.xes.end(),
+               [](const Binding &a, const Binding &b) { return a.x < b.x; });
+          r->xes = arena.array(f.xes);
+          r->e = expr;
+          expr = r;
+          stack.pop_back();
+          break;
+        }
+        case FrameType::APP:
+          if (f.expr != nullptr) {
+            auto e = arena.make<App>();
+            e->e1 = f.expr;
+            e->e2 = expr;
+            expr = e;
+          }
+          f.expr = expr;
+          if (match_arg()) {
+            start = true;
+            arg = true;
+          } else if (match(TokenType::LAMBDA) || match(TokenType::LET) ||
+                     match(TokenType::REC)) {
+            f.T = FrameType::APP_LAST;
+            start = true;
+            arg = false;
+          } else {
+            stack.pop_back();
+          }
+          break;
+        case FrameType::APP_LAST: {
+          auto e = arena.make<App>();
+          e->e1 = f.expr;
+          e->e2 = expr;
+          expr = e;
+          stack.pop_back();
+          break;
+        }
+        case FrameType::PARENTHESIS:
+          expect(TokenType::RIGHT_PARENTHESIS);
+          stack.pop_back();
+          break;
+        case FrameType::CASE_E: {
+          auto c = f.expr->as<Case>();
+          c->e = expr;
+          expect(TokenType::OF);
+          Ref<Poly> g;
+          if (accept(TokenType::COLON)) {
+            map<string, Ref<Mono>> m;
+            g = parse_polytype(m);
+          }
+          c->gadt = g;
+          expect(TokenType::LEFT_BRACE);
+          f.T = FrameType::CASE_BRANCH;
+          parse_branch(f);
+          start = true;
+          arg = false;
+          break;
+        }
+        case FrameType::CASE_BRANCH:
+          f.pes.back().e = expr;
+          if (!match(TokenType::RIGHT_BRACE)) {
+            expect(TokenType::SEMICOLON);
+          }
+          if (match(TokenType::RIGHT_BRACE)) {
+            expect(TokenType::RIGHT_BRACE);
+            auto c = f.expr->as<Case>();
+            sort(f.pes.begin(), f.pes.end(),
+                 [](const Branch &a, const Branch &b) { return a.c < b.c; });
+            c->pes = arena.array(f.pes);
+            expr = c;
+            stack.pop_back();
+          } else {
+            parse_branch(f);
+            start = true;
+            arg = false;
+          }
+          break;
+      }
     }
-    return expr;
   }
 
-  shared_ptr<Expr> parse_ffi() {
+  Expr *parse_ffi() {
     expect(TokenType::FFI);
-    auto expr = make_shared<Expr>();
-    expr->T = ExprType::FFI;
-    expr->ffi = make_shared<Ffi>();
-    stringstream s(t.data);
-    s.get();
-    s.get();
-    s.get();
-    string sep;
-    s >> sep;
-    size_t a = t.data.find(sep);
-    expr->ffi->source =
-        t.data.substr(a + sep.size(), t.data.size() - (a + 2 * sep.size()));
+    auto expr = unit->arena.make<Ffi>();
+    auto data = t.data;
+    size_t a = 3;
+    while (is_space(data[a])) {
+      a++;
+    }
+    size_t b = a;
+    while (!is_space(data[b])) {
+      b++;
+    }
+    auto source = expr->source = data.substr(b, data.size() - b - (b - a));
+    vector<StringView> vars;
     size_t idx = 0;
-    while (idx < expr->ffi->source.length() &&
-           (idx = expr->ffi->source.find("$", idx)) != string::npos) {
-      if (++idx < expr->ffi->source.length()) {
-        char c = expr->ffi->source[idx];
+    while (idx < source.length() &&
+           (idx = source.find(StringView("$"), idx)) != StringView::npos) {
+      if (++idx < source.length()) {
+        char c = source[idx];
         if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_') {
-          string v;
-          v.push_back(c);
+          size_t begin = idx;
           idx++;
-          while (idx < expr->ffi->source.length()) {
-            c = expr->ffi->source[idx];
+          while (idx < source.length()) {
+            c = source[idx];
             if (!(('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
                   ('a' <= c && c <= 'z') || c == '_' || c == '\'')) {
               break;
             }
-            v.push_back(c);
             idx++;
           }
+          vars.push_back(source.substr(begin, idx - begin));
         } else {
           string data = t.data;
           if (data.length() > 78) {
@@ -354,96 +575,41 @@ struct Parser {
         exit(EXIT_FAILURE);
       }
     }
+    expr->vars = unit->arena.array(vars);
+    expr->slots = unit->arena.array(vector<uint32_t>(vars.size(), NO_SLOT));
     return expr;
   }
-  shared_ptr<Expr> parse_expr__() {
-    auto expr = make_shared<Expr>();
-    if (accept(TokenType::IDENTIFIER)) {
-      expr->T = ExprType::VAR;
-      expr->x = t.data;
-    } else if (accept(TokenType::LEFT_PARENTHESIS)) {
-      expr = parse_expr();
-      expect(TokenType::RIGHT_PARENTHESIS);
-    } else if (accept(TokenType::CASE)) {
-      expr->T = ExprType::CASE;
-      expr->e = parse_expr();
-      expect(TokenType::OF);
-      shared_ptr<Poly> g;
-      if (accept(TokenType::COLON)) {
-        map<string, shared_ptr<Mono>> m;
-        g = parse_polytype(m);
-      }
-      expr->gadt = g;
-      expect(TokenType::LEFT_BRACE);
-      string data_name;
-      do {
-        expect(TokenType::IDENTIFIER);
-        if (!unit->cons.count(t.data)) {
-          string data = t.data;
-          if (data.length() > 78) {
-            data = data.substr(0, 75) + "...";
-          }
-          cerr << "parser: " << to_string(t.position)
-               << " constructor not found" << endl
-               << "`" << data << "`" << endl;
-          exit(EXIT_FAILURE);
-        }
-        if (expr->pes.count(t.data)) {
+  // Parses the `import`s that start a unit. The modules they name have to be
+  // loaded into the unit before the rest of it is parsed.
+  shared_ptr<Unit> parse_imports() {
+    unit = make_shared<Unit>();
+    while (accept(TokenType::IMPORT)) {
+      expect(TokenType::IDENTIFIER);
+      for (auto &i : unit->imports) {
+        if (t.data == i.module.c_str()) {
           string data = t.data;
           if (data.length() > 78) {
             data = data.substr(0, 75) + "...";
           }
           cerr << "parser: " << to_string(t.position)
-               << " constructors conflict" << endl
-               << "`" << data << "`" << endl;
-          exit(EXIT_FAILURE);
-        }
-        string cname = t.data;
-        expr->pes[cname] = make_pair(vector<string>{}, nullptr);
-        auto &pes = expr->pes[cname];
-        auto c = unit->cons[cname];
-        if (data_name.empty()) {
-          data_name = c->data_name;
-        } else if (data_name != c->data_name) {
-          string data = t.data;
-          if (data.length() > 78) {
-            data = data.substr(0, 75) + "...";
-          }
-          cerr << "parser: " << to_string(t.position) << " constructor of "
-               << data_name << " expected, but found" << endl
+               << " module names conflict" << endl
                << "`" << data << "`" << endl;
           exit(EXIT_FAILURE);
         }
-        set<string> st;
-        for (size_t i = 0; i < c->arg; i++) {
-          expect(TokenType::IDENTIFIER);
-          if (st.count(t.data)) {
-            string data = t.data;
-            if (data.length() > 78) {
-              data = data.substr(0, 75) + "...";
-            }
-            cerr << "parser: " << to_string(t.position)
-                 << " variable names conflict" << endl
-                 << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
-          }
-          st.insert(t.data);
-          pes.first.push_back(t.data);
-        }
-        expect(TokenType::RIGHTARROW);
-        pes.second = parse_expr();
-        if (!match(TokenType::RIGHT_BRACE)) {
-          expect(TokenType::SEMICOLON);
-        }
-      } while (!match(TokenType::RIGHT_BRACE));
-      expect(TokenType::RIGHT_BRACE);
-    } else {
-      expr = parse_ffi();
+      }
+      Import i;
+      i.module = t.data;
+      i.pos = t.position;
+      unit->imports.push_back(i);
     }
-    return expr;
+    return unit;
   }
+  // Parses the rest of the unit after parse_imports, or a whole unit that
+  // imports nothing.
   shared_ptr<Unit> parse() {
-    unit = make_shared<Unit>();
+    if (unit == nullptr) {
+      unit = make_shared<Unit>();
+    }
     while (accept(TokenType::DATA)) {
       parse_data();
     }
@@ -0,0 +1,112 @@
+#ifndef SU_BOLEYN_BSL_RESOLVE_H
+#define SU_BOLEYN_BSL_RESOLVE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ds/data.h"
+#include "ds/expr.h"
+#include "ds/unit.h"
+
+using namespace std;
+
+// Gives every constructor and every binder in the unit a slot of its own, and
+// every variable the slot of the binder it refers to, so that later passes
+// never look a variable up by name. A variable bound nowhere gets NO_SLOT and
+// is reported by type inference.
+struct Resolver {
+  shared_ptr<Unit> unit;
+  map<string, vector<uint32_t>> scope;
+  Resolver(shared_ptr<Unit> unit) : unit(unit) {
+    for (auto dai : unit->data) {
+      for (auto &c : dai.second->constructors) {
+        c->slot = bind(c->name);
+      }
+    }
+    resolve(unit->expr);
+  }
+  uint32_t bind(const string &x) {
+    scope[x].push_back(unit->slots);
+    return unit->slots++;
+  }
+  void unbind(const string &x) {
+    auto &v = scope[x];
+    v.pop_back();
+    if (v.empty()) {
+      scope.erase(x);
+    }
+  }
+  uint32_t lookup(const string &x) {
+    auto it = scope.find(x);
+    if (it != scope.end()) {
+      return it->second.back();
+    } else {
+      return NO_SLOT;
+    }
+  }
+  void resolve(Expr *e) {
+    switch (e->T) {
+      case ExprType::VAR: {
+        auto v = e->as<Var>();
+        v->slot = lookup(v->x);
+      } break;
+      case ExprType::APP: {
+        auto a = e->as<App>();
+        resolve(a->e1);
+        resolve(a->e2);
+      } break;
+      case ExprType::ABS: {
+        auto a = e->as<Abs>();
+        a->slot = bind(a->x);
+        resolve(a->e);
+        unbind(a->x);
+      } break;
+      case ExprType::LET: {
+        auto l = e->as<Let>();
+        resolve(l->e1);
+        l->slot = bind(l->x);
+        resolve(l->e2);
+        unbind(l->x);
+      } break;
+      case ExprType::REC: {
+        auto r = e->as<Rec>();
+        r->slot = unit->slots;
+        for (auto &xe : r->xes) {
+          bind(xe.x);
+        }
+        for (auto &xe : r->xes) {
+          resolve(xe.e);
+        }
+        resolve(r->e);
+        for (auto &xe : r->xes) {
+          unbind(xe.x);
+        }
+      } break;
+      case ExprType::CASE: {
+        auto c = e->as<Case>();
+        resolve(c->e);
+        for (auto &pes : c->pes) {
+          pes.slot = unit->slots;
+          for (auto &x : pes.xs) {
+            bind(x);
+          }
+          resolve(pes.e);
+          for (auto &x : pes.xs) {
+            unbind(x);
+          }
+        }
+      } break;
+      case ExprType::FFI: {
+        auto f = e->as<Ffi>();
+        for (size_t i = 0; i < f->vars.size(); i++) {
+          f->slots[i] = lookup(f->vars[i]);
+        }
+      } break;
+    }
+  }
+};
+
+#endif
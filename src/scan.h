@@ -0,0 +1,216 @@
+#ifndef SU_BOLEYN_BSL_SCAN_H
+#define SU_BOLEYN_BSL_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BSL_SCAN_X86
+#endif
+
+using namespace std;
+
+// The scans the lexer spends its time in on large inputs: past blanks, to the
+// end of a comment, and to the separator that closes an ffi block. Each has
+// a scalar version and, on x86, SSE2 and AVX2 ones that test 16 or 32 bytes
+// at a time. The widest one the CPU supports is picked when first used.
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+struct Scalar {
+  // Returns the first byte in [p, end) that is not blank, or end.
+  static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    return p;
+  }
+  // Returns the first byte in [p, end) that is a or b, or end.
+  static const char *find_either(const char *p, const char *end, char a,
+                                 char b) {
+    while (p < end && *p != a && *p != b) {
+      p++;
+    }
+    return p;
+  }
+  // Returns the first p in [p, end) such that s starts at p, or end.
+  static const char *find(const char *p, const char *end, const char *s,
+                          size_t n) {
+    if (n == 0) {
+      return p;
+    }
+    while (p + n <= end) {
+      p = static_cast<const char *>(memchr(p, s[0], end - p - (n - 1)));
+      if (p == nullptr) {
+        break;
+      }
+      if (memcmp(p, s, n) == 0) {
+        return p;
+      }
+      p++;
+    }
+    return end;
+  }
+};
+
+#ifdef BSL_SCAN_X86
+
+// The loops over blocks of V::W bytes. V::mask* sets bit i of the result
+// when byte i of the block passes the test.
+template <typename V>
+struct Blocks {
+  static const char *skip_blanks(const char *p, const char *end) {
+    for (; p + V::W <= end; p += V::W) {
+      uint32_t m = ~V::mask_blank(p) & V::ALL;
+      if (m != 0) {
+        return p + __builtin_ctz(m);
+      }
+    }
+    return Scalar::skip_blanks(p, end);
+  }
+  static const char *find_either(const char *p, const char *end, char a,
+                                 char b) {
+    for (; p + V::W <= end; p += V::W) {
+      uint32_t m = V::mask_eq(p, a) | V::mask_eq(p, b);
+      if (m != 0) {
+        return p + __builtin_ctz(m);
+      }
+    }
+    return Scalar::find_either(p, end, a, b);
+  }
+  // Tests the first and the last byte of s at once, and only compares the
+  // rest where both match.
+  static const char *find(const char *p, const char *end, const char *s,
+                          size_t n) {
+    if (n == 0) {
+      return p;
+    }
+    for (; p + (n - 1) + V::W <= end; p += V::W) {
+      uint32_t m = V::mask_eq(p, s[0]) & V::mask_eq(p + (n - 1), s[n - 1]);
+      while (m != 0) {
+        auto q = p + __builtin_ctz(m);
+        if (memcmp(q, s, n) == 0) {
+          return q;
+        }
+        m &= m - 1;
+      }
+    }
+    return Scalar::find(p, end, s, n);
+  }
+};
+
+struct Sse2 {
+  static const size_t W = 16;
+  static const uint32_t ALL = 0xffff;
+  __attribute__((target("sse2"))) static uint32_t mask_eq(const char *p,
+                                                          char c) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+  }
+  __attribute__((target("sse2"))) static uint32_t mask_blank(const char *p) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    auto m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return _mm_movemask_epi8(m);
+  }
+};
+
+struct Avx2 {
+  static const size_t W = 32;
+  static const uint32_t ALL = 0xffffffff;
+  __attribute__((target("avx2"))) static uint32_t mask_eq(const char *p,
+                                                          char c) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+  }
+  __attribute__((target("avx2"))) static uint32_t mask_blank(const char *p) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    auto m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    return _mm256_movemask_epi8(m);
+  }
+};
+
+// The entry points flatten every call into them, so that the masks are
+// inlined into loops compiled for the same instruction set.
+struct Sse2Scan {
+  __attribute__((target("sse2"), flatten)) static const char *skip_blanks(
+      const char *p, const char *end) {
+    return Blocks<Sse2>::skip_blanks(p, end);
+  }
+  __attribute__((target("sse2"), flatten)) static const char *find_either(
+      const char *p, const char *end, char a, char b) {
+    return Blocks<Sse2>::find_either(p, end, a, b);
+  }
+  __attribute__((target("sse2"), flatten)) static const char *find(
+      const char *p, const char *end, const char *s, size_t n) {
+    return Blocks<Sse2>::find(p, end, s, n);
+  }
+};
+
+struct Avx2Scan {
+  __attribute__((target("avx2"), flatten)) static const char *skip_blanks(
+      const char *p, const char *end) {
+    return Blocks<Avx2>::skip_blanks(p, end);
+  }
+  __attribute__((target("avx2"), flatten)) static const char *find_either(
+      const char *p, const char *end, char a, char b) {
+    return Blocks<Avx2>::find_either(p, end, a, b);
+  }
+  __attribute__((target("avx2"), flatten)) static const char *find(
+      const char *p, const char *end, const char *s, size_t n) {
+    return Blocks<Avx2>::find(p, end, s, n);
+  }
+};
+
+#endif
+
+struct Scanner {
+  const char *(*skip_blanks)(const char *, const char *);
+  const char *(*find_either)(const char *, const char *, char, char);
+  const char *(*find)(const char *, const char *, const char *, size_t);
+  const char *name;
+};
+
+template <typename S>
+Scanner make_scanner(const char *name) {
+  Scanner s = {S::skip_blanks, S::find_either, S::find, name};
+  return s;
+}
+
+// The scanner for the CPU we run on. BSL_SCAN=scalar, sse2 or avx2 in the
+// environment forces one, for testing and measuring.
+const Scanner &scanner() {
+  static Scanner s = []() {
+    const char *force = getenv("BSL_SCAN");
+    string want = force != nullptr ? force : "";
+    if (want == "scalar") {
+      return make_scanner<Scalar>("scalar");
+    }
+#ifdef BSL_SCAN_X86
+    __builtin_cpu_init();
+    if (want != "sse2" && __builtin_cpu_supports("avx2")) {
+      return make_scanner<Avx2Scan>("avx2");
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return make_scanner<Sse2Scan>("sse2");
+    }
+#endif
+    return make_scanner<Scalar>("scalar");
+  }();
+  return s;
+}
+
+#endif
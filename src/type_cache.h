@@ -0,0 +1,647 @@
+#ifndef SU_BOLEYN_BSL_TYPE_CACHE_H
+#define SU_BOLEYN_BSL_TYPE_CACHE_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ds/data.h"
+#include "ds/expr.h"
+#include "ds/string_view.h"
+#include "ds/type.h"
+#include "ds/unit.h"
+
+using namespace std;
+
+enum class TypeTag : uint8_t { VAR, CONST, VAR_CONST, POLY_MONO, POLY };
+
+// Types are written as a table of nodes in postorder, so that a node shared by
+// several parents is written once and a deep type needs no recursion. A node
+// refers to the nodes below it by their position in the table. Kind variables
+// are numbered once per writer, so kinds shared between the types written
+// together stay shared when they are read back.
+struct TypeWriter {
+  string out;
+  map<uint32_t, uint32_t> kinds;
+  // whether every type variable written was bound by a forall
+  bool closed = true;
+  void u8(uint8_t x) { out.push_back(char(x)); }
+  void u32(uint32_t x) {
+    while (x >= 0x80) {
+      u8(uint8_t(x | 0x80));
+      x >>= 7;
+    }
+    u8(uint8_t(x));
+  }
+  void u64(uint64_t x) {
+    for (size_t i = 0; i < 8; i++) {
+      u8(uint8_t(x >> (8 * i)));
+    }
+  }
+  void str(StringView s) {
+    u32(s.size());
+    out.append(s.data(), s.size());
+  }
+  void str(const string &s) { str(StringView(s.data(), s.size())); }
+  void kind(Ref<Kind> k) {
+    k = find(k);
+    if (k->is_const) {
+      if (k->is_arrow) {
+        u8(1);
+        kind(k->left);
+        kind(k->right);
+      } else {
+        u8(0);
+      }
+    } else {
+      u8(2);
+      if (!kinds.count(k.id)) {
+        auto n = kinds.size();
+        kinds[k.id] = n;
+      }
+      u32(kinds[k.id]);
+    }
+  }
+  void type(Ref<Poly> sigma) {
+    struct Node {
+      Ref<Mono> tau;
+      Ref<Poly> sigma;
+      bool expanded;
+    };
+    unordered_map<uint32_t, uint32_t> monos, polys;
+    unordered_set<uint32_t> bound;
+    uint32_t n = 0;
+    string rest;
+    rest.swap(out);
+    vector<Node> stack;
+    stack.push_back(Node{nullptr, sigma, false});
+    while (!stack.empty()) {
+      auto node = stack.back();
+      if (node.sigma != nullptr) {
+        if (polys.count(node.sigma.id)) {
+          stack.pop_back();
+          continue;
+        }
+        vector<Ref<Mono>> alphas;
+        auto p = node.sigma;
+        while (!p->is_mono) {
+          alphas.push_back(find(p->alpha));
+          p = p->sigma;
+        }
+        auto tau = find(p->tau);
+        if (!node.expanded) {
+          stack.back().expanded = true;
+          for (auto alpha : alphas) {
+            bound.insert(alpha.id);
+          }
+          stack.push_back(Node{tau, nullptr, false});
+          for (size_t i = alphas.size(); i-- > 0;) {
+            stack.push_back(Node{alphas[i], nullptr, false});
+          }
+        } else {
+          stack.pop_back();
+          u8(uint8_t(TypeTag::POLY));
+          u32(alphas.size());
+          for (auto alpha : alphas) {
+            u32(monos.at(alpha.id));
+          }
+          u32(monos.at(tau.id));
+          polys[node.sigma.id] = n++;
+        }
+      } else {
+        auto tau = node.tau;
+        if (monos.count(tau.id)) {
+          stack.pop_back();
+          continue;
+        }
+        if (!node.expanded) {
+          stack.back().expanded = true;
+          if (is_c(tau)) {
+            if (is_p(tau)) {
+              stack.push_back(Node{nullptr, tau->sigma, false});
+            } else {
+              for (size_t i = tau->tau.size(); i-- > 0;) {
+                stack.push_back(Node{find(tau->tau[i]), nullptr, false});
+              }
+              if (!is_cd(tau)) {
+                stack.push_back(Node{find(tau->D.d), nullptr, false});
+              }
+            }
+          }
+        } else {
+          stack.pop_back();
+          if (is_c(tau)) {
+            if (is_p(tau)) {
+              u8(uint8_t(TypeTag::POLY_MONO));
+              kind(tau->kind);
+              u32(polys.at(tau->sigma.id));
+            } else {
+              if (is_cd(tau)) {
+                u8(uint8_t(TypeTag::CONST));
+                str(name_of(tau->D.D));
+                kind(tau->kind);
+              } else {
+                u8(uint8_t(TypeTag::VAR_CONST));
+                kind(tau->kind);
+                u32(monos.at(find(tau->D.d).id));
+              }
+              u32(tau->tau.size());
+              for (auto t : tau->tau) {
+                u32(monos.at(find(t).id));
+              }
+            }
+          } else {
+            if (!is_f(tau) || !bound.count(tau.id)) {
+              closed = false;
+            }
+            u8(uint8_t(TypeTag::VAR));
+            u8(is_f(tau));
+            kind(tau->kind);
+          }
+          monos[tau.id] = n++;
+        }
+      }
+    }
+    string records;
+    records.swap(out);
+    out.swap(rest);
+    u32(n);
+    out += records;
+  }
+  // Only used for hashing, so it needs not be read back.
+  void expr(Expr *e) {
+    u8(uint8_t(e->T));
+    u8(e->sig != nullptr);
+    if (e->sig != nullptr) {
+      type(e->sig);
+    }
+    switch (e->T) {
+      case ExprType::VAR:
+        str(e->as<Var>()->x);
+        break;
+      case ExprType::APP:
+        expr(e->as<App>()->e1);
+        expr(e->as<App>()->e2);
+        break;
+      case ExprType::ABS:
+        str(e->as<Abs>()->x);
+        expr(e->as<Abs>()->e);
+        break;
+      case ExprType::LET:
+        str(e->as<Let>()->x);
+        expr(e->as<Let>()->e1);
+        expr(e->as<Let>()->e2);
+        break;
+      case ExprType::REC: {
+        auto r = e->as<Rec>();
+        u32(r->xes.size());
+        for (auto &xe : r->xes) {
+          str(xe.x);
+          expr(xe.e);
+        }
+        expr(r->e);
+      } break;
+      case ExprType::CASE: {
+        auto c = e->as<Case>();
+        expr(c->e);
+        u8(c->gadt != nullptr);
+        if (c->gadt != nullptr) {
+          type(c->gadt);
+        }
+        u32(c->pes.size());
+        for (auto &pes : c->pes) {
+          str(pes.c);
+          u32(pes.xs.size());
+          for (auto &x : pes.xs) {
+            str(x);
+          }
+          expr(pes.e);
+        }
+      } break;
+      case ExprType::FFI:
+        str(e->as<Ffi>()->source);
+        break;
+    }
+  }
+};
+
+// Reads what a TypeWriter wrote. Anything malformed clears ok instead of being
+// trusted, so that a damaged cache file is only a cache miss.
+struct TypeReader {
+  const string &in;
+  size_t pos;
+  bool ok;
+  map<uint32_t, Ref<Kind>> kinds;
+  TypeReader(const string &in, size_t pos = 0) : in(in), pos(pos), ok(true) {}
+  uint8_t u8() {
+    if (pos < in.size()) {
+      return uint8_t(in[pos++]);
+    } else {
+      ok = false;
+      return 0;
+    }
+  }
+  uint32_t u32() {
+    uint32_t x = 0;
+    for (size_t s = 0; s < 35; s += 7) {
+      auto b = u8();
+      x |= uint32_t(b & 0x7f) << s;
+      if (!(b & 0x80)) {
+        return x;
+      }
+    }
+    ok = false;
+    return 0;
+  }
+  uint64_t u64() {
+    uint64_t x = 0;
+    for (size_t i = 0; i < 8; i++) {
+      x |= uint64_t(u8()) << (8 * i);
+    }
+    return x;
+  }
+  string str() {
+    auto n = u32();
+    if (!ok || in.size() - pos < n) {
+      ok = false;
+      return "";
+    }
+    pos += n;
+    return in.substr(pos - n, n);
+  }
+  Ref<Kind> kind() {
+    switch (u8()) {
+      case 0:
+        return new_const_kind();
+      case 1: {
+        auto l = kind();
+        auto r = kind();
+        return new_kind(l, r);
+      }
+      case 2: {
+        auto i = u32();
+        if (!kinds.count(i)) {
+          kinds[i] = new_kind();
+        }
+        return kinds[i];
+      }
+      default:
+        ok = false;
+        return new_const_kind();
+    }
+  }
+  Ref<Poly> type() {
+    vector<Ref<Mono>> monos;
+    vector<Ref<Poly>> polys;
+    auto mono = [&]() -> Ref<Mono> {
+      auto i = u32();
+      if (i < monos.size() && monos[i] != nullptr) {
+        return monos[i];
+      } else {
+        ok = false;
+        return nullptr;
+      }
+    };
+    auto n = u32();
+    for (uint32_t i = 0; i < n && ok; i++) {
+      monos.push_back(nullptr);
+      polys.push_back(nullptr);
+      auto tag = TypeTag(u8());
+      switch (tag) {
+        case TypeTag::VAR: {
+          bool forall = u8();
+          auto k = kind();
+          if (!forall) {
+            ok = false;
+          }
+          monos[i] = new_forall_var(k);
+        } break;
+        case TypeTag::CONST:
+        case TypeTag::VAR_CONST: {
+          Ref<Mono> t;
+          if (tag == TypeTag::CONST) {
+            auto name = str();
+            t = new_const(name, kind());
+          } else {
+            auto k = kind();
+            auto d = mono();
+            t = new_const(d, k);
+          }
+          auto m = u32();
+          for (uint32_t j = 0; j < m && ok; j++) {
+            t->tau.push_back(mono());
+          }
+          monos[i] = t;
+        } break;
+        case TypeTag::POLY_MONO: {
+          auto k = kind();
+          auto j = u32();
+          if (j < polys.size() && polys[j] != nullptr) {
+            monos[i] = new_const(polys[j], k);
+          } else {
+            ok = false;
+          }
+        } break;
+        case TypeTag::POLY: {
+          vector<Ref<Mono>> alphas;
+          auto m = u32();
+          for (uint32_t j = 0; j < m && ok; j++) {
+            auto alpha = mono();
+            if (ok && !is_f(alpha)) {
+              ok = false;
+            }
+            alphas.push_back(alpha);
+          }
+          auto p = new_poly(mono());
+          for (size_t j = alphas.size(); j-- > 0;) {
+            p = new_poly(alphas[j], p);
+          }
+          polys[i] = p;
+        } break;
+        default:
+          ok = false;
+      }
+    }
+    if (ok && !polys.empty() && polys.back() != nullptr) {
+      return polys.back();
+    } else {
+      ok = false;
+      return nullptr;
+    }
+  }
+};
+
+// Inferred types are kept on disk in dir, in files named after a key. The key
+// of the data declarations hashes all of them, and the key of a top-level
+// binding group hashes the key before it and the group itself, so a group is
+// reused only after exactly the same declarations and bindings. Programs that
+// start with the same prelude thus share the entries of the prelude.
+struct TypeCache {
+  static const uint8_t VERSION = 1;
+  string dir;
+  string chunk;
+  unique_ptr<TypeReader> reader;
+  string pending;
+  uint64_t first;
+  TypeCache(const string &dir) : dir(dir) { mkdir(dir.c_str(), 0777); }
+
+  static uint64_t hash(const string &s) {
+    uint64_t h = 14695981039346656037ull;
+    for (auto c : s) {
+      h ^= uint8_t(c);
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+  uint64_t data_key(shared_ptr<Unit> unit) {
+    TypeWriter w;
+    w.u8(VERSION);
+    w.u32(unit->data.size());
+    for (auto &dai : unit->data) {
+      auto da = dai.second;
+      w.str(da->name);
+      w.u32(da->arg);
+      w.u32(da->constructors.size());
+      for (auto &c : da->constructors) {
+        w.str(c->name);
+        w.u32(c->arg);
+        w.type(c->sig);
+      }
+    }
+    return hash(w.out);
+  }
+  // The key of the top-level `let` or `rec` e after the group with key.
+  uint64_t group_key(uint64_t key, Expr *e) {
+    TypeWriter w;
+    w.u64(key);
+    if (e->T == ExprType::LET) {
+      w.str(e->as<Let>()->x);
+      w.expr(e->as<Let>()->e1);
+    } else {
+      w.u32(e->as<Rec>()->xes.size());
+      for (auto &xe : e->as<Rec>()->xes) {
+        w.str(xe.x);
+        w.expr(xe.e);
+      }
+    }
+    return hash(w.out);
+  }
+
+  string path(uint64_t key) {
+    stringstream s;
+    s << dir << "/" << hex;
+    s.width(16);
+    s.fill('0');
+    s << key;
+    return s.str();
+  }
+  bool read(uint64_t key, string &data) {
+    ifstream in(path(key), ios::binary);
+    if (!in) {
+      return false;
+    }
+    stringstream s;
+    s << in.rdbuf();
+    data = s.str();
+    return data.size() >= 5 && data.substr(0, 4) == "BSLT" &&
+           uint8_t(data[4]) == VERSION;
+  }
+  // Writes to a file of its own first, so that a compilation running at the
+  // same time never reads half an entry.
+  void write(uint64_t key, const string &data) {
+    auto file = path(key);
+    auto tmp = file + "." + to_string(getpid());
+    {
+      ofstream out(tmp, ios::binary);
+      out << "BSLT" << char(VERSION) << data;
+      if (!out) {
+        remove(tmp.c_str());
+        return;
+      }
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+      remove(tmp.c_str());
+    }
+  }
+
+  // Loads the kinds of the data types and the checked constructor types,
+  // with the forall variables of each constructor that are existential.
+  bool load_data(uint64_t key, shared_ptr<Unit> unit,
+                 map<uint32_t, Ref<Kind>> &kind,
+                 map<string, set<Ref<Mono>>> &exists) {
+    string data;
+    if (!read(key, data)) {
+      return false;
+    }
+    TypeReader r(data, 5);
+    map<uint32_t, Ref<Kind>> kind_;
+    map<string, set<Ref<Mono>>> exists_;
+    map<string, Ref<Poly>> sig;
+    if (r.u32() != unit->data.size()) {
+      return false;
+    }
+    for (auto &dai : unit->data) {
+      auto da = dai.second;
+      if (r.str() != da->name) {
+        return false;
+      }
+      kind_[intern(da->name)] = r.kind();
+      if (r.u32() != da->constructors.size()) {
+        return false;
+      }
+      for (auto &c : da->constructors) {
+        if (r.str() != c->name) {
+          return false;
+        }
+        auto s = sig[c->name] = r.type();
+        if (!r.ok) {
+          return false;
+        }
+        vector<Ref<Mono>> alphas;
+        for (; !s->is_mono; s = s->sigma) {
+          alphas.push_back(s->alpha);
+        }
+        auto n = r.u32();
+        for (uint32_t i = 0; i < n && r.ok; i++) {
+          auto j = r.u32();
+          if (j < alphas.size()) {
+            exists_[c->name].insert(alphas[j]);
+          } else {
+            return false;
+          }
+        }
+      }
+    }
+    if (!r.ok || r.pos != data.size()) {
+      return false;
+    }
+    for (auto &k : kind_) {
+      kind[k.first] = k.second;
+    }
+    for (auto &e : exists_) {
+      exists[e.first] = e.second;
+    }
+    for (auto &dai : unit->data) {
+      for (auto &c : dai.second->constructors) {
+        c->sig = sig[c->name];
+      }
+    }
+    return true;
+  }
+  void save_data(uint64_t key, shared_ptr<Unit> unit,
+                 map<uint32_t, Ref<Kind>> &kind,
+                 map<string, set<Ref<Mono>>> &exists) {
+    TypeWriter w;
+    w.u32(unit->data.size());
+    for (auto &dai : unit->data) {
+      auto da = dai.second;
+      w.str(da->name);
+      w.kind(kind[intern(da->name)]);
+      w.u32(da->constructors.size());
+      for (auto &c : da->constructors) {
+        w.str(c->name);
+        w.type(c->sig);
+        vector<uint32_t> es;
+        auto s = c->sig;
+        for (uint32_t i = 0; !s->is_mono; s = s->sigma, i++) {
+          if (exists.count(c->name) && exists[c->name].count(s->alpha)) {
+            es.push_back(i);
+          }
+        }
+        w.u32(es.size());
+        for (auto i : es) {
+          w.u32(i);
+        }
+      }
+    }
+    if (w.closed) {
+      write(key, w.out);
+    }
+  }
+
+  // The names bound by the top-level `let` or `rec` e, in slot order.
+  static vector<string> names(Expr *e) {
+    vector<string> xs;
+    if (e->T == ExprType::LET) {
+      xs.push_back(e->as<Let>()->x);
+    } else {
+      for (auto &xe : e->as<Rec>()->xes) {
+        xs.push_back(xe.x);
+      }
+    }
+    return xs;
+  }
+
+  // Loads the schemes of the top-level `let` or `rec` e, whose key is key.
+  // Groups are looked up in source order: the groups after one found in a
+  // file are looked for in the rest of that file first.
+  bool load(uint64_t key, Expr *e, vector<Ref<Poly>> &schemes) {
+    if (reader == nullptr || reader->pos == chunk.size() ||
+        reader->u64() != key) {
+      reader.reset();
+      if (!read(key, chunk)) {
+        return false;
+      }
+      reader.reset(new TypeReader(chunk, 5));
+      if (reader->u64() != key) {
+        reader.reset();
+        return false;
+      }
+    }
+    auto xs = names(e);
+    vector<Ref<Poly>> schemes_;
+    bool ok = reader->u32() == xs.size();
+    for (size_t i = 0; i < xs.size() && ok && reader->ok; i++) {
+      ok = reader->str() == xs[i];
+      schemes_.push_back(reader->type());
+    }
+    if (ok && reader->ok) {
+      schemes = schemes_;
+      return true;
+    }
+    reader.reset();
+    return false;
+  }
+  // Adds the schemes of the group e with key to the file being written, which
+  // holds a run of groups inferred one after another and is named after the
+  // first. A scheme with free type or kind variables is not saved, as those
+  // would have to stay linked to the ones in other groups, and ends the run.
+  void save(uint64_t key, Expr *e, const vector<Ref<Poly>> &schemes) {
+    auto xs = names(e);
+    TypeWriter w;
+    w.u64(key);
+    w.u32(schemes.size());
+    for (size_t i = 0; i < schemes.size(); i++) {
+      w.str(xs[i]);
+      w.type(schemes[i]);
+    }
+    if (w.closed && w.kinds.empty()) {
+      if (pending.empty()) {
+        first = key;
+      }
+      pending += w.out;
+    } else {
+      flush();
+    }
+  }
+  void flush() {
+    if (!pending.empty()) {
+      write(first, pending);
+      pending.clear();
+    }
+  }
+};
+
+#endif
@@ -2,123 +2,151 @@
 #define SU_BOLEYN_BSL_TYPE_INFER_H
 
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "ds/data.h"
 #include "ds/expr.h"
+#include "ds/stats.h"
 #include "ds/type.h"
 #include "ds/unit.h"
+#include "type_cache.h"
 
 using namespace std;
 
 struct TypeInfer {
   struct Context {
-    map<string, vector<shared_ptr<Poly>>> type;
-    map<string, shared_ptr<Kind>> kind;
-    map<string, set<shared_ptr<Mono>>> exists;
-    bool has__env(const string &key) {
-      auto it = type.find(key);
-      if (it != type.end() && it->second.size()) {
-        return true;
-      } else {
-        return false;
-      }
-    }
-    shared_ptr<Poly> get__env(const string &key) {
-      auto it = type.find(key);
-      if (it != type.end() && it->second.size()) {
-        return it->second.back();
-      } else {
-        assert(false);
-        return nullptr;
-      }
+    // the scheme bound to each slot; workers share the one of their parent,
+    // and as every binder has a slot of its own they never write the same one
+    shared_ptr<vector<Ref<Poly>>> type;
+    map<uint32_t, Ref<Kind>> kind;
+    map<string, set<Ref<Mono>>> exists;
+    bool has__env(uint32_t slot) {
+      return slot != NO_SLOT && (*type)[slot] != nullptr;
     }
-    void set__env(const string &key, shared_ptr<Poly> value) {
-      type[key].push_back(value);
+    Ref<Poly> get__env(uint32_t slot) {
+      assert(has__env(slot));
+      return (*type)[slot];
     }
-    void unset__env(const string &key) {
-      auto &v = type[key];
-      v.pop_back();
-      if (v.empty()) {
-        type.erase(key);
-      }
-    }
-    void add_exists(string c, shared_ptr<Mono> t) { exists[c].insert(t); }
-    set<shared_ptr<Mono>> &get_exists(string c) { return exists[c]; }
+    void set__env(uint32_t slot, Ref<Poly> value) { (*type)[slot] = value; }
+    void unset__env(uint32_t slot) { (*type)[slot] = nullptr; }
+    void add_exists(string c, Ref<Mono> t) { exists[c].insert(t); }
+    set<Ref<Mono>> &get_exists(string c) { return exists[c]; }
   } context;
   shared_ptr<Unit> unit;
-  TypeInfer(shared_ptr<Unit> unit) : unit(unit) {
-    context.kind["->"] = new_kind(new_const_kind(), new_const_kind());
-    for (auto dai : unit->data) {
-      auto da = dai.second;
-      context.kind[da->name] = new_kind();
-      auto k = context.kind[da->name];
-      for (size_t i = 0; i < da->arg; i++) {
-        auto ret = new_kind();
-        unify(k, new_kind(new_kind(), ret), nullptr);
-        k = ret;
+  // Type errors are written to err and end the compilation in fail(). A
+  // worker buffers them instead and gives up on its binding group.
+  ostream &err;
+  bool worker;
+  TypeCache *cache;
+  struct Failure {};
+  [[noreturn]] void fail() {
+    if (worker) {
+      throw Failure();
+    } else {
+      if (cache != nullptr) {
+        cache->flush();
       }
-      unify(k, new_const_kind(), nullptr);
+      exit(EXIT_FAILURE);
     }
-    for (auto dai : unit->data) {
-      auto da = dai.second;
-      for (auto &c : da->constructors) {
-        check(da, c);
+  }
+  TypeInfer(shared_ptr<Unit> unit, size_t threads = 1,
+            TypeCache *cache = nullptr)
+      : unit(unit), err(cerr), worker(false), cache(cache) {
+    context.type = make_shared<vector<Ref<Poly>>>(unit->slots);
+    context.kind[ARROW] = new_kind(new_const_kind(), new_const_kind());
+    uint64_t key = cache != nullptr ? cache->data_key(unit) : 0;
+    if (cache == nullptr ||
+        !cache->load_data(key, unit, context.kind, context.exists)) {
+      for (auto dai : unit->data) {
+        auto da = dai.second;
+        context.kind[intern(da->name)] = new_kind();
+        auto k = context.kind[intern(da->name)];
+        for (size_t i = 0; i < da->arg; i++) {
+          auto ret = new_kind();
+          unify(k, new_kind(new_kind(), ret), nullptr);
+          k = ret;
+        }
+        unify(k, new_const_kind(), nullptr);
+      }
+      for (auto dai : unit->data) {
+        auto da = dai.second;
+        for (auto &c : da->constructors) {
+          check(da, c);
+        }
+      }
+      if (cache != nullptr) {
+        cache->save_data(key, unit, context.kind, context.exists);
       }
-      //      cerr << da->name << ":" << to_string(context.kind[da->name]) <<
-      //      endl;
     }
     for (auto dai : unit->data) {
       auto da = dai.second;
       for (auto &c : da->constructors) {
-        //        cerr << c->name << " : " << to_string(c->sig) << endl;
-        context.set__env(c->name, c->sig);
+        context.set__env(c->slot, c->sig);
       }
     }
-    infer(unit->expr, nullptr);
+    if (threads > 1 || cache != nullptr || !unit->module.empty()) {
+      infer_groups(threads, key);
+    } else {
+      infer(unit->expr, nullptr);
+    }
     for (auto dai : unit->data) {
       auto da = dai.second;
       for (auto &c : da->constructors) {
-        context.unset__env(c->name);
+        context.unset__env(c->slot);
       }
     }
   }
-  void check(shared_ptr<Data> da, shared_ptr<Constructor> c, shared_ptr<Mono> p,
-             set<shared_ptr<Mono>> &st) {
+  // A worker that infers a single binding group against the data types and
+  // constructors of parent.
+  TypeInfer(TypeInfer &parent, ostream &err, bool worker)
+      : unit(parent.unit),
+        err(err),
+        worker(worker),
+        cache(worker ? nullptr : parent.cache) {
+    context.type = parent.context.type;
+    context.kind = parent.context.kind;
+    context.exists = parent.context.exists;
+  }
+  void check(shared_ptr<Data> da, shared_ptr<Constructor> c, Ref<Mono> p,
+             set<Ref<Mono>> &st) {
     if (is_fun(p)) {
       assert(p->tau.size() == 2);
       if (is_p(p->tau[1])) {
-        cerr << "type error: a `forall` can be moved to left hand of `->`"
-             << endl
-             << "in constructor " << c->name << ":" << to_string(c->sig)
-             << endl;
-        exit(EXIT_FAILURE);
+        err << "type error: a `forall` can be moved to left hand of `->`"
+            << endl
+            << "in constructor " << c->name << ":" << to_string(c->sig)
+            << endl;
+        fail();
       }
       check(da, c, p->tau[1], st);
-      if (!unify(p->tau[1]->kind, new_const_kind(), &cerr)) {
-        cerr << "in constructor " << c->name << ":" << to_string(c->sig)
-             << endl;
-        exit(EXIT_FAILURE);
+      if (!unify(p->tau[1]->kind, new_const_kind(), &err)) {
+        err << "in constructor " << c->name << ":" << to_string(c->sig) << endl;
+        fail();
       }
       check(c->sig, p->tau[0], st);
-      if (!unify(p->tau[0]->kind, new_const_kind(), &cerr)) {
-        cerr << "in constructor " << c->name << ":" << to_string(c->sig)
-             << endl;
-        exit(EXIT_FAILURE);
+      if (!unify(p->tau[0]->kind, new_const_kind(), &err)) {
+        err << "in constructor " << c->name << ":" << to_string(c->sig) << endl;
+        fail();
       }
       p->kind = new_const_kind();
     } else {
-      if (!is_cd(p) || p->D.D != da->name) {
-        cerr << "in constructor " << c->name << ":" << to_string(c->sig) << endl
-             << "return type is not `" << da->name << "`" << endl;
-        exit(EXIT_FAILURE);
+      if (!is_cd(p) || p->D.D != intern(da->name)) {
+        err << "in constructor " << c->name << ":" << to_string(c->sig) << endl
+            << "return type is not `" << da->name << "`" << endl;
+        fail();
       }
       check(c->sig, p, st);
       for (auto t : st) {
@@ -129,14 +157,14 @@ struct TypeInfer {
   }
   void check(shared_ptr<Data> da, shared_ptr<Constructor> c) {
     auto p = c->sig;
-    set<shared_ptr<Mono>> st;
+    set<Ref<Mono>> st;
     while (!p->is_mono) {
       st.insert(p->alpha);
       p = p->sigma;
     }
     check(da, c, p->tau, st);
   }
-  bool occ(shared_ptr<Kind> a, shared_ptr<Kind> b) {
+  bool occ(Ref<Kind> a, Ref<Kind> b) {
     b = find(b);
     if (b->is_const) {
       if (b->is_arrow) {
@@ -148,7 +176,7 @@ struct TypeInfer {
       return a == b;
     }
   }
-  bool unify(shared_ptr<Kind> a, shared_ptr<Kind> b, ostream *cerr) {
+  bool unify(Ref<Kind> a, Ref<Kind> b, ostream *cerr) {
     a = find(a);
     b = find(b);
     if (a != b) {
@@ -196,6 +224,11 @@ struct TypeInfer {
           return true;
         }
       } else {
+        if (a->rank > b->rank) {
+          a.swap(b);
+        } else if (a->rank == b->rank) {
+          b->rank++;
+        }
         a->par = b;
         return true;
       }
@@ -203,8 +236,7 @@ struct TypeInfer {
       return true;
     }
   }
-  void check(shared_ptr<Poly> t, shared_ptr<Mono> p,
-             set<shared_ptr<Mono>> &st) {
+  void check(Ref<Poly> t, Ref<Mono> p, set<Ref<Mono>> &st) {
     if (is_c(p)) {
       if (is_p(p)) {
         check(t, p->sigma, st);
@@ -214,42 +246,41 @@ struct TypeInfer {
           if (is_fun(p)) {
             assert(p->tau.size() == 2);
             check(t, p->tau[0], st);
-            if (!unify(p->tau[0]->kind, new_const_kind(), &cerr)) {
-              cerr << "in signature " << to_string(t) << endl;
-              exit(EXIT_FAILURE);
+            if (!unify(p->tau[0]->kind, new_const_kind(), &err)) {
+              err << "in signature " << to_string(t) << endl;
+              fail();
             }
             if (is_p(p->tau[1])) {
-              cerr << "type error: a `forall` can be moved to left hand of `->`"
-                   << endl
-                   << "in signature " << to_string(t) << endl;
-              exit(EXIT_FAILURE);
+              err << "type error: a `forall` can be moved to left hand of `->`"
+                  << endl
+                  << "in signature " << to_string(t) << endl;
+              fail();
             }
             check(t, p->tau[1], st);
-            if (!unify(p->tau[1]->kind, new_const_kind(), &cerr)) {
-              cerr << "in signature " << to_string(t) << endl;
-              exit(EXIT_FAILURE);
+            if (!unify(p->tau[1]->kind, new_const_kind(), &err)) {
+              err << "in signature " << to_string(t) << endl;
+              fail();
             }
-            p->kind = new_const_kind();
           } else {
-            if (unit->data.count(p->D.D)) {
+            if (unit->data.count(name_of(p->D.D))) {
               auto k = context.kind[p->D.D];
               for (size_t i = 0; i < p->tau.size(); i++) {
                 auto ret = new_kind();
                 check(t, p->tau[i], st);
-                if (!unify(new_kind(p->tau[i]->kind, ret), k, &cerr)) {
-                  cerr << "in signature " << to_string(t) << endl;
-                  exit(EXIT_FAILURE);
+                if (!unify(new_kind(p->tau[i]->kind, ret), k, &err)) {
+                  err << "in signature " << to_string(t) << endl;
+                  fail();
                 }
                 k = ret;
               }
-              if (!unify(k, p->kind, &cerr)) {
-                cerr << "in signature " << to_string(t) << endl;
-                exit(EXIT_FAILURE);
+              if (!unify(k, p->kind, &err)) {
+                err << "in signature " << to_string(t) << endl;
+                fail();
               }
             } else {
-              cerr << "in signature " << to_string(t) << endl
-                   << "`" << p->D.D << "` is not a type" << endl;
-              exit(EXIT_FAILURE);
+              err << "in signature " << to_string(t) << endl
+                  << "`" << name_of(p->D.D) << "` is not a type" << endl;
+              fail();
             }
           }
         } else {
@@ -257,15 +288,15 @@ struct TypeInfer {
           for (size_t i = 0; i < p->tau.size(); i++) {
             auto ret = new_kind();
             check(t, p->tau[i], st);
-            if (!unify(new_kind(p->tau[i]->kind, ret), k, &cerr)) {
-              cerr << "in signature " << to_string(t) << endl;
-              exit(EXIT_FAILURE);
+            if (!unify(new_kind(p->tau[i]->kind, ret), k, &err)) {
+              err << "in signature " << to_string(t) << endl;
+              fail();
             }
             k = ret;
           }
-          if (!unify(k, p->kind, &cerr)) {
-            cerr << "in signature " << to_string(t) << endl;
-            exit(EXIT_FAILURE);
+          if (!unify(k, p->kind, &err)) {
+            err << "in signature " << to_string(t) << endl;
+            fail();
           }
         }
       }
@@ -273,41 +304,37 @@ struct TypeInfer {
       st.erase(p);
     }
   }
-  void check(shared_ptr<Poly> t, shared_ptr<Poly> p,
-             set<shared_ptr<Mono>> &st) {
+  void check(Ref<Poly> t, Ref<Poly> p, set<Ref<Mono>> &st) {
     while (!p->is_mono) {
       st.insert(p->alpha);
       p = p->sigma;
     }
     check(t, p->tau, st);
   }
-  void check(shared_ptr<Poly> t) {
-    set<shared_ptr<Mono>> st;
+  void check(Ref<Poly> t) {
+    set<Ref<Mono>> st;
     check(t, t, st);
   }
 
-  shared_ptr<Poly> gen(shared_ptr<Mono> tau,
-                       set<shared_ptr<Mono>> *exists_var = nullptr) {
-    tau = find(tau);
-    set<shared_ptr<Mono>> f;
-    for (auto &c : context.type) {
-      set<shared_ptr<Mono>> fi;
-      assert(context.has__env(c.first));
-      ftv(fi, context.get__env(c.first));
-      f.insert(fi.begin(), fi.end());
+  Ref<Poly> gen(Ref<Mono> tau, set<Ref<Mono>> *exists_var = nullptr) {
+    if (stats_enabled) {
+      thread_stats.gen++;
     }
-    set<shared_ptr<Mono>> fp;
+    tau = find(tau);
+    set<Ref<Mono>> fp;
     ftv(fp, tau);
-    for (auto i : f) {
-      fp.erase(i);
-    }
-    map<shared_ptr<Mono>, shared_ptr<Mono>> m;
+    map<Ref<Mono>, Ref<Mono>> m;
     for (auto f : fp) {
+      // a variable reachable from the context has been bound at or adjusted
+      // to a level not deeper than the current one
+      if (f->level <= current_level) {
+        continue;
+      }
       if (exists_var != nullptr && exists_var->count(f)) {
-        cerr << "type error: an existential type should not escape its scope"
-             << endl;
-        cerr << to_string(tau) << endl;
-        exit(EXIT_FAILURE);
+        err << "type error: an existential type should not escape its scope"
+            << endl;
+        err << to_string(tau) << endl;
+        fail();
       }
       if (is_f(f)) {
         m[f] = new_forall_var(f->kind);
@@ -322,46 +349,206 @@ struct TypeInfer {
     return g;
   }
 
-  bool occ(shared_ptr<Mono> a, shared_ptr<Poly> b) {
-    if (b->is_mono) {
-      return occ(a, b->tau);
-    } else {
-      return occ(a, b->sigma);
+  void adjust(Ref<Mono> tau, uint32_t level, uint32_t visit) {
+    vector<Ref<Mono>> stack(1, tau);
+    while (!stack.empty()) {
+      tau = find(stack.back());
+      stack.pop_back();
+      if (tau->is_ground) {
+        continue;
+      }
+      if (is_c(tau)) {
+        if (tau->visit == visit) {
+          continue;
+        }
+        tau->visit = visit;
+        if (is_p(tau)) {
+          stack.push_back(get_mono(tau->sigma));
+        } else {
+          if (!is_cd(tau)) {
+            stack.push_back(tau->D.d);
+          }
+          for (size_t i = 0; i < tau->tau.size(); i++) {
+            stack.push_back(tau->tau[i]);
+          }
+        }
+      } else if (tau->level > level) {
+        tau->level = level;
+      }
     }
   }
 
-  bool occ(shared_ptr<Mono> a, shared_ptr<Mono> b) {
-    b = find(b);
-    if (is_c(b)) {
-      if (is_p(b)) {
-        return occ(a, b->sigma);
-      } else {
-        if (!is_cd(b)) {
-          if (occ(a, b->D.d)) {
-            return true;
+  void bind(Ref<Mono> a, Ref<Mono> b) {
+    a->par = b;
+    adjust(b, a->level, new_visit());
+  }
+
+  // Binds one of two unconstrained flexible variables to the other, the one
+  // of lower rank, so that the trees find() walks stay shallow.
+  void link(Ref<Mono> a, Ref<Mono> b) {
+    if (a->rank > b->rank) {
+      a.swap(b);
+    } else if (a->rank == b->rank) {
+      b->rank++;
+    }
+    bind(a, b);
+  }
+
+  bool occ(Ref<Mono> a, Ref<Mono> b, uint32_t visit) {
+    vector<Ref<Mono>> stack(1, b);
+    while (!stack.empty()) {
+      b = find(stack.back());
+      stack.pop_back();
+      if (b->is_ground) {
+        continue;
+      }
+      if (is_c(b)) {
+        if (b->visit == visit) {
+          continue;
+        }
+        b->visit = visit;
+        if (is_p(b)) {
+          stack.push_back(get_mono(b->sigma));
+        } else {
+          if (!is_cd(b)) {
+            stack.push_back(b->D.d);
+          }
+          for (size_t i = 0; i < b->tau.size(); i++) {
+            stack.push_back(b->tau[i]);
           }
         }
-        for (size_t i = 0; i < b->tau.size(); i++) {
-          if (occ(a, b->tau[i])) {
-            return true;
+      } else if (a == b) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool occ(Ref<Mono> a, Ref<Mono> b) {
+    if (stats_enabled) {
+      thread_stats.occ++;
+    }
+    return occ(a, b, new_visit());
+  }
+
+  // Pairs of polytypes already found equivalent. Types are only ever bound
+  // further, so an equivalence once found is never lost.
+  set<pair<Ref<Poly>, Ref<Poly>>> equivalent;
+
+  // Checks in one pass that a and b are the same polytype up to the names and
+  // order of their quantifiers, without instantiating either. Each quantified
+  // variable acts as a skolem that may only meet one skolem of the other
+  // side, quantified by the matching forall. Free variables must already be
+  // the same on both sides. A false answer only means that the two cannot be
+  // told apart without unification. The kinds of the skolems that meet are
+  // only unified once the walk has succeeded, so a false answer binds
+  // nothing.
+  bool equiv(Ref<Poly> a, Ref<Poly> b) {
+    if (a == b || equivalent.count(make_pair(a, b))) {
+      return true;
+    }
+    // the forall that quantifies each skolem, and the skolem it has met
+    map<Ref<Mono>, pair<size_t, Ref<Mono>>> skolem_a, skolem_b;
+    size_t scope = 0;
+    vector<pair<Ref<Mono>, Ref<Mono>>> work;
+    vector<pair<Ref<Kind>, Ref<Kind>>> kinds;
+    auto skolemize = [&](Ref<Poly> x, Ref<Poly> y) {
+      for (scope++; !x->is_mono; x = x->sigma) {
+        skolem_a[x->alpha] = make_pair(scope, Ref<Mono>());
+      }
+      for (; !y->is_mono; y = y->sigma) {
+        skolem_b[y->alpha] = make_pair(scope, Ref<Mono>());
+      }
+      work.push_back(make_pair(x->tau, y->tau));
+    };
+    skolemize(a, b);
+    while (!work.empty()) {
+      auto x = find(work.back().first);
+      auto y = find(work.back().second);
+      work.pop_back();
+      if (x == y && x->is_ground) {
+        continue;
+      }
+      if (is_c(x) != is_c(y)) {
+        return false;
+      } else if (!is_c(x)) {
+        auto sx = skolem_a.find(x);
+        auto sy = skolem_b.find(y);
+        if (sx == skolem_a.end() && sy == skolem_b.end()) {
+          if (x != y) {
+            return false;
           }
+        } else if (sx == skolem_a.end() || sy == skolem_b.end() ||
+                   sx->second.first != sy->second.first) {
+          return false;
+        } else if (sx->second.second == nullptr &&
+                   sy->second.second == nullptr) {
+          kinds.push_back(make_pair(x->kind, y->kind));
+          sx->second.second = y;
+          sy->second.second = x;
+        } else if (sx->second.second != y || sy->second.second != x) {
+          return false;
+        }
+      } else if (is_p(x) || is_p(y)) {
+        if (!is_p(x) || !is_p(y)) {
+          return false;
+        }
+        skolemize(x->sigma, y->sigma);
+      } else if (is_cd(x) != is_cd(y) || x->tau.size() != y->tau.size()) {
+        return false;
+      } else {
+        if (is_cd(x)) {
+          if (x->D.D != y->D.D) {
+            return false;
+          }
+        } else {
+          work.push_back(make_pair(x->D.d, y->D.d));
+        }
+        for (size_t i = x->tau.size(); i-- > 0;) {
+          work.push_back(make_pair(x->tau[i], y->tau[i]));
         }
       }
-      return false;
-    } else {
-      return a == b;
     }
+    for (auto &k : kinds) {
+      if (!unify(k.first, k.second, nullptr)) {
+        return false;
+      }
+    }
+    equivalent.insert(make_pair(a, b));
+    equivalent.insert(make_pair(b, a));
+    return true;
+  }
+
+  // Unifies a and b. Pairs of arguments wait on a worklist rather than the
+  // native stack, and are taken in the order a recursive descent would take
+  // them; only the instances of Poly nodes are unified by a nested call.
+  bool unify(Ref<Mono> a, Ref<Mono> b, ostream *cerr,
+             set<Ref<Mono>> *st = nullptr) {
+    if (stats_enabled) {
+      thread_stats.unify++;
+    }
+    vector<pair<Ref<Mono>, Ref<Mono>>> work(1, make_pair(a, b));
+    while (!work.empty()) {
+      auto p = work.back();
+      work.pop_back();
+      if (!unify(p.first, p.second, cerr, st, work)) {
+        return false;
+      }
+    }
+    return true;
   }
 
-  bool unify(shared_ptr<Mono> a, shared_ptr<Mono> b, ostream *cerr,
-             set<shared_ptr<Mono>> *st = nullptr) {
+  bool unify(Ref<Mono> a, Ref<Mono> b, ostream *cerr, set<Ref<Mono>> *st,
+             vector<pair<Ref<Mono>, Ref<Mono>>> &work) {
     a = find(a);
     b = find(b);
     if (a != b) {
       if (is_c(a)) {
         if (is_c(b)) {
           if (is_p(a) && is_p(b)) {
-            if (st != nullptr) {
+            if (equiv(a->sigma, b->sigma)) {
+              return true;
+            } else if (st != nullptr) {
               if (!unify(inst_get_set(a->sigma, *st), inst(b->sigma), cerr,
                          st)) {
                 return false;
@@ -369,13 +556,15 @@ struct TypeInfer {
                 return true;
               }
             } else {
-              set<shared_ptr<Mono>> sta, stb;
+              set<Ref<Mono>> sta, stb;
               if (!unify(inst_get_set(a->sigma, sta), inst(b->sigma), cerr,
                          &sta) ||
                   !unify(inst_get_set(b->sigma, stb), inst(a->sigma), cerr,
                          &stb)) {
                 return false;
               } else {
+                equivalent.insert(make_pair(a->sigma, b->sigma));
+                equivalent.insert(make_pair(b->sigma, a->sigma));
                 return true;
               }
             }
@@ -387,7 +576,7 @@ struct TypeInfer {
               }
               return false;
             } else {
-              set<shared_ptr<Mono>> sta;
+              set<Ref<Mono>> sta;
               if (!unify(inst_get_set(a->sigma, sta), b, cerr, &sta)) {
                 return false;
               } else {
@@ -410,7 +599,8 @@ struct TypeInfer {
               for (size_t i = 0; i < a->tau.size(); i++) {
                 na->tau.push_back(a->tau[i]);
               }
-              return unify(na, b, cerr, st);
+              work.push_back(make_pair(na, b));
+              return true;
             } else if (!is_cd(b) && is_cd(find(b->D.d))) {
               b->D.d = find(b->D.d);
               auto nb = new_const(b->D.d->D.D, b->kind);
@@ -420,7 +610,8 @@ struct TypeInfer {
               for (size_t i = 0; i < b->tau.size(); i++) {
                 nb->tau.push_back(b->tau[i]);
               }
-              return unify(a, nb, cerr, st);
+              work.push_back(make_pair(a, nb));
+              return true;
             } else if (a->tau.size() == b->tau.size()) {
               if (is_cd(a) && is_cd(b)) {
                 if (a->D.D != b->D.D) {
@@ -432,7 +623,7 @@ struct TypeInfer {
                 }
               } else if (is_cd(a)) {
                 b->D.d = find(b->D.d);
-                if (st != nullptr && st->count(b->D.d)) {
+                if ((st != nullptr && st->count(b->D.d)) || is_e(b->D.d)) {
                   if (cerr != nullptr) {
                     (*cerr)
                         << "type error: " << to_string(b->D.d) << " !< "
@@ -441,13 +632,13 @@ struct TypeInfer {
                   }
                   return false;
                 } else {
-                  b->D.d->par = new_const(a->D.D, context.kind[a->D.D]);
+                  bind(b->D.d, new_const(a->D.D, context.kind[a->D.D]));
                   b->D.is_const = true;
                   b->D.D = a->D.D;
                 }
               } else if (is_cd(b)) {
                 a->D.d = find(a->D.d);
-                if (st != nullptr && st->count(a->D.d)) {
+                if ((st != nullptr && st->count(a->D.d)) || is_e(a->D.d)) {
                   if (cerr != nullptr) {
                     (*cerr)
                         << "type error: " << to_string(a->D.d) << " !< "
@@ -456,7 +647,7 @@ struct TypeInfer {
                   }
                   return false;
                 } else {
-                  a->D.d->par = new_const(b->D.D, context.kind[b->D.D]);
+                  bind(a->D.d, new_const(b->D.D, context.kind[b->D.D]));
                   a->D.is_const = true;
                   a->D.D = b->D.D;
                 }
@@ -464,25 +655,27 @@ struct TypeInfer {
                 a->D.d = find(a->D.d);
                 b->D.d = find(b->D.d);
                 if (a->D.d != b->D.d) {
-                  if (st != nullptr && st->count(b->D.d)) {
-                    if (st != nullptr && st->count(a->D.d)) {
+                  if ((st != nullptr && st->count(b->D.d)) || is_e(b->D.d)) {
+                    if ((st != nullptr && st->count(a->D.d)) ||
+                        is_e(a->D.d)) {
                       if (cerr != nullptr) {
                         (*cerr) << "type error: " << to_string(a)
                                 << " != " << to_string(b) << endl;
                       }
                       return false;
                     } else {
-                      a->D.d->par = b->D.d;
+                      bind(a->D.d, b->D.d);
                     }
+                  } else if (is_f(a->D.d) && is_f(b->D.d) &&
+                             (st == nullptr || !st->count(a->D.d))) {
+                    link(b->D.d, a->D.d);
                   } else {
-                    b->D.d->par = a->D.d;
+                    bind(b->D.d, a->D.d);
                   }
                 }
               }
-              for (size_t i = 0; i < a->tau.size(); i++) {
-                if (!unify(a->tau[i], b->tau[i], cerr, st)) {
-                  return false;
-                }
+              for (size_t i = a->tau.size(); i-- > 0;) {
+                work.push_back(make_pair(a->tau[i], b->tau[i]));
               }
               return true;
             } else {
@@ -495,47 +688,39 @@ struct TypeInfer {
                   return false;
                 }
                 b->D.d = find(b->D.d);
-                shared_ptr<Kind> k;
-                shared_ptr<Mono> h, hnt;
+                Ref<Kind> k;
+                Ref<Mono> h;
                 if (is_cd(a)) {
                   k = context.kind[a->D.D];
                   h = new_const(a->D.D, k);
-                  hnt = new_const(a->D.D, k);
                 } else {
                   a->D.d = find(a->D.d);
                   k = a->D.d->kind;
                   h = new_const(a->D.d, k);
-                  hnt = new_const(a->D.d, k);
                 }
                 for (size_t i = 0; i + b->tau.size() < a->tau.size(); i++) {
                   h->tau.push_back(a->tau[i]);
-                  hnt->tau.push_back(a->tau[i]);
                   auto t = new_kind();
                   if (!unify(k, new_kind(a->tau[i]->kind, t), cerr)) {
                     return false;
                   }
                   k = t;
                 }
-                if (st != nullptr && st->count(b->D.d)) {
+                if ((st != nullptr && st->count(b->D.d)) || is_e(b->D.d)) {
                   if (cerr != nullptr) {
                     (*cerr) << "type error: " << to_string(b->D.d) << " !< "
                             << to_string(h) << endl;
                   }
                   return false;
                 } else {
-                  b->D.d->par = h;
+                  bind(b->D.d, h);
                   if (!unify(k, b->D.d->kind, cerr)) {
                     return false;
                   }
-                  for (size_t i = 0; i < b->tau.size(); i++) {
-                    hnt->tau.push_back(
-                        a->tau[a->tau.size() - b->tau.size() + i]);
-                    if (!unify(a->tau[a->tau.size() - b->tau.size() + i],
-                               b->tau[i], cerr, st)) {
-                      return false;
-                    }
+                  for (size_t i = b->tau.size(); i-- > 0;) {
+                    work.push_back(make_pair(
+                        a->tau[a->tau.size() - b->tau.size() + i], b->tau[i]));
                   }
-                  b.swap(hnt);
                   return true;
                 }
               } else {
@@ -547,48 +732,39 @@ struct TypeInfer {
                   return false;
                 }
                 a->D.d = find(a->D.d);
-                shared_ptr<Kind> k;
-                shared_ptr<Mono> h, hnt;
+                Ref<Kind> k;
+                Ref<Mono> h;
                 if (is_cd(b)) {
                   k = context.kind[b->D.D];
                   h = new_const(b->D.D, k);
-                  hnt = new_const(b->D.D, k);
                 } else {
                   b->D.d = find(b->D.d);
                   k = b->D.d->kind;
                   h = new_const(b->D.d, k);
-                  hnt = new_const(b->D.d, k);
                 }
                 for (size_t i = 0; i + a->tau.size() < b->tau.size(); i++) {
                   h->tau.push_back(b->tau[i]);
-                  hnt->tau.push_back(b->tau[i]);
                   auto t = new_kind();
                   if (!unify(k, new_kind(b->tau[i]->kind, t), cerr)) {
                     return false;
                   }
                   k = t;
                 }
-                if (st != nullptr && !st->count(a->D.d)) {
+                if ((st != nullptr && !st->count(a->D.d)) || is_e(a->D.d)) {
                   if (cerr != nullptr) {
                     (*cerr) << "type error: " << to_string(a->D.d) << " !< "
                             << to_string(h) << endl;
                   }
                   return false;
                 } else {
-                  a->D.d->par = h;
+                  bind(a->D.d, h);
                   if (!unify(k, a->D.d->kind, cerr)) {
                     return false;
                   }
-                  for (size_t i = 0; i < a->tau.size(); i++) {
-                    hnt->tau.push_back(
-                        b->tau[b->tau.size() - a->tau.size() + i]);
-                    if (!unify(a->tau[i],
-                               b->tau[b->tau.size() - a->tau.size() + i], cerr,
-                               st)) {
-                      return false;
-                    }
+                  for (size_t i = a->tau.size(); i-- > 0;) {
+                    work.push_back(make_pair(
+                        a->tau[i], b->tau[b->tau.size() - a->tau.size() + i]));
                   }
-                  a.swap(hnt);
                   return true;
                 }
               }
@@ -613,7 +789,7 @@ struct TypeInfer {
                   }
                   return false;
                 } else {
-                  b->par = a;
+                  bind(b, a);
                   return true;
                 }
               }
@@ -628,7 +804,7 @@ struct TypeInfer {
                   }
                   return false;
                 } else {
-                  b->par = a;
+                  bind(b, a);
                   return true;
                 }
               }
@@ -660,7 +836,7 @@ struct TypeInfer {
                 }
                 return false;
               } else {
-                a->par = b;
+                bind(a, b);
                 return true;
               }
             }
@@ -677,11 +853,14 @@ struct TypeInfer {
                 }
                 return false;
               } else {
-                a->par = b;
+                bind(a, b);
                 return true;
               }
+            } else if (st == nullptr || !st->count(a)) {
+              link(b, a);
+              return true;
             } else {
-              b->par = a;
+              bind(b, a);
               return true;
             }
           }
@@ -696,7 +875,7 @@ struct TypeInfer {
               }
               return false;
             } else {
-              a->par = b;
+              bind(a, b);
               return true;
             }
           }
@@ -719,7 +898,7 @@ struct TypeInfer {
               }
               return false;
             } else {
-              b->par = a;
+              bind(b, a);
               return true;
             }
           }
@@ -736,42 +915,116 @@ struct TypeInfer {
     }
   }
 
-  shared_ptr<Mono> infer(shared_ptr<Expr> e, shared_ptr<Poly> sig) {
-    shared_ptr<Mono> ty;
+  // Infers the bindings of the `let` or `rec` e, but not its body, and returns
+  // their type schemes in the order of their slots.
+  void infer_bindings(Expr *e, vector<Ref<Poly>> &schemes) {
+    schemes.clear();
+    if (e->T == ExprType::LET) {
+      auto l = e->as<Let>();
+      enter_level();
+      auto ty1 = infer(l->e1, nullptr);
+      leave_level();
+      if (l->e1->sig != nullptr) {
+        schemes.push_back(l->e1->sig);
+      } else {
+        schemes.push_back(gen(ty1));
+      }
+    } else {
+      auto r = e->as<Rec>();
+      vector<Ref<Mono>> tys;
+      enter_level();
+      size_t i = 0;
+      for (auto &xe : r->xes) {
+        tys.push_back(nullptr);
+        if (xe.e->sig != nullptr) {
+          context.set__env(r->slot + i, xe.e->sig);
+        } else {
+          tys[i] = new_forall_var(new_const_kind());
+          context.set__env(r->slot + i, new_poly(tys[i]));
+        }
+        i++;
+      }
+      i = 0;
+      for (auto &xe : r->xes) {
+        auto ty_ = infer(xe.e, nullptr);
+        if (xe.e->sig == nullptr) {
+          if (!unify(tys[i], ty_, &err)) {
+            string data = to_string(e, 0, "  ");
+            if (data.length() > 78) {
+              data = data.substr(0, 75) + "...";
+            }
+            err << "`" << data << "`" << endl;
+            fail();
+          }
+        }
+        i++;
+      }
+      for (i = 0; i < r->xes.size(); i++) {
+        context.unset__env(r->slot + i);
+      }
+      leave_level();
+      for (auto &xe : r->xes) {
+        if (xe.e->T != ExprType::ABS) {
+          err << "type error: rec of this type is not supported" << endl;
+          string data = to_string(e, 0, "  ");
+          if (data.length() > 78) {
+            data = data.substr(0, 75) + "...";
+          }
+          err << "`" << data << "`" << endl;
+          fail();
+        }
+      }
+      i = 0;
+      for (auto &xe : r->xes) {
+        if (xe.e->sig != nullptr) {
+          schemes.push_back(xe.e->sig);
+        } else {
+          schemes.push_back(gen(tys[i]));
+        }
+        i++;
+      }
+    }
+  }
+
+  Ref<Mono> infer(Expr *e, Ref<Poly> sig) {
+    Ref<Mono> ty;
     if (e->sig != nullptr) {
       check(e->sig);
       if (sig != nullptr) {
-        cerr << "type error: the signature cannot be here" << endl;
+        err << "type error: the signature cannot be here" << endl;
         string data = to_string(e, 0, "  ");
         if (data.length() > 78) {
           data = data.substr(0, 75) + "...";
         }
-        cerr << "`" << data << "`" << endl;
-        exit(EXIT_FAILURE);
+        err << "`" << data << "`" << endl;
+        fail();
       }
       sig = e->sig;
     }
     switch (e->T) {
-      case ExprType::VAR:
-        if (context.has__env(e->x)) {
-          auto t = context.get__env(e->x);
+      case ExprType::VAR: {
+        auto v = e->as<Var>();
+        if (context.has__env(v->slot)) {
+          auto t = context.get__env(v->slot);
           ty = inst(t);
         } else {
-          cerr << "type error: " << e->x << " is not in context" << endl;
+          err << "type error: " << v->x << " is not in context" << endl;
           string data = to_string(e, 0, "  ");
           if (data.length() > 78) {
             data = data.substr(0, 75) + "...";
           }
-          cerr << "`" << data << "`" << endl;
-          exit(EXIT_FAILURE);
+          err << "`" << data << "`" << endl;
+          fail();
         }
         break;
+      }
       case ExprType::APP: {
-        shared_ptr<Mono> ty1, ty2;
+        auto a = e->as<App>();
+        Ref<Mono> ty1, ty2;
         if (sig == nullptr) {
-          ty1 = infer(e->e1, nullptr);
+          ty1 = infer(a->e1, nullptr);
         } else {
-          vector<shared_ptr<Mono>> mv;
+          vector<Ref<Mono>> mv;
           auto t = new_fun();
           t->tau.push_back(new_forall_var(new_const_kind()));
           auto sig_ = sig;
@@ -784,66 +1037,67 @@ struct TypeInfer {
           for (auto m : mv) {
             po = new_poly(m, po);
           }
-          ty1 = infer(e->e1, po);
+          ty1 = infer(a->e1, po);
         }
         ty = new_forall_var(new_const_kind());
         if (is_fun(find(ty1)) && is_p(find(find(ty1)->tau[0]))) {
-          if (!unify(find(ty1)->tau[1], ty, &cerr)) {
+          if (!unify(find(ty1)->tau[1], ty, &err)) {
             string data = to_string(e, 0, "  ");
             if (data.length() > 78) {
               data = data.substr(0, 75) + "...";
             }
-            cerr << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
+            err << "`" << data << "`" << endl;
+            fail();
           }
-          ty2 = infer(e->e2, find(find(ty1)->tau[0])->sigma);
+          ty2 = infer(a->e2, find(find(ty1)->tau[0])->sigma);
         } else {
-          ty2 = infer(e->e2, nullptr);
+          ty2 = infer(a->e2, nullptr);
           auto t = new_fun();
           t->tau.push_back(ty2);
           t->tau.push_back(ty);
-          if (!unify(ty1, t, &cerr)) {
+          if (!unify(ty1, t, &err)) {
             string data = to_string(e, 0, "  ");
             if (data.length() > 78) {
               data = data.substr(0, 75) + "...";
             }
-            cerr << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
+            err << "`" << data << "`" << endl;
+            fail();
           }
         }
         break;
       }
       case ExprType::ABS: {
-        shared_ptr<Mono> ty_;
+        auto a = e->as<Abs>();
+        Ref<Mono> ty_;
         if (sig != nullptr) {
           ty = inst(sig);
           if (is_fun(ty)) {
             if (is_p(ty->tau[0])) {
-              context.set__env(e->x, ty->tau[0]->sigma);
+              context.set__env(a->slot, ty->tau[0]->sigma);
             } else {
-              context.set__env(e->x, new_poly(ty->tau[0]));
+              context.set__env(a->slot, new_poly(ty->tau[0]));
             }
             if (is_p(ty->tau[1])) {
-              ty_ = infer(e->e, ty->tau[1]->sigma);
+              ty_ = infer(a->e, ty->tau[1]->sigma);
             } else {
-              ty_ = infer(e->e, new_poly(ty->tau[1]));
+              ty_ = infer(a->e, new_poly(ty->tau[1]));
             }
-            context.unset__env(e->x);
+            context.unset__env(a->slot);
           } else {
-            cerr << "type error: `" << to_string(ty)
-                 << "` is not of a function type" << endl;
+            err << "type error: `" << to_string(ty)
+                << "` is not of a function type" << endl;
             string data = to_string(e, 0, "  ");
             if (data.length() > 78) {
               data = data.substr(0, 75) + "...";
             }
-            cerr << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
+            err << "`" << data << "`" << endl;
+            fail();
           }
         } else {
           auto tau = new_forall_var(new_const_kind());
-          context.set__env(e->x, new_poly(tau));
-          ty_ = infer(e->e, nullptr);
-          context.unset__env(e->x);
+          context.set__env(a->slot, new_poly(tau));
+          ty_ = infer(a->e, nullptr);
+          context.unset__env(a->slot);
           ty = new_fun();
           ty->tau.push_back(tau);
           ty->tau.push_back(ty_);
@@ -851,250 +1105,218 @@ struct TypeInfer {
         break;
       }
       case ExprType::LET: {
-        shared_ptr<Mono> ty1, ty2;
-        ty1 = infer(e->e1, nullptr);
-        if (e->e1->sig != nullptr) {
-          context.set__env(e->x, e->e1->sig);
-        } else {
-          context.set__env(e->x, gen(ty1));
-        }
-        //        cerr << e->x << " : "
-        //             << (e->e1->sig != nullptr ? to_string(e->e1->sig)
-        //                                       : to_string(gen(ty1)))
-        //             << endl;
-        ty2 = infer(e->e2, sig);
-        context.unset__env(e->x);
-        ty = ty2;
+        auto l = e->as<Let>();
+        vector<Ref<Poly>> schemes;
+        infer_bindings(e, schemes);
+        context.set__env(l->slot, schemes[0]);
+        ty = infer(l->e2, sig);
+        context.unset__env(l->slot);
         break;
       }
       case ExprType::REC: {
-        map<string, shared_ptr<Mono>> tys;
-        shared_ptr<Mono> ty_;
-        for (auto &xe : e->xes) {
-          if (xe.second->sig != nullptr) {
-            context.set__env(xe.first, xe.second->sig);
-          } else {
-            tys[xe.first] = new_forall_var(new_const_kind());
-            context.set__env(xe.first, new_poly(tys[xe.first]));
-          }
-        }
-        for (auto &xe : e->xes) {
-          auto ty_ = infer(xe.second, nullptr);
-          if (xe.second->sig == nullptr) {
-            if (!unify(tys[xe.first], ty_, &cerr)) {
-              string data = to_string(e, 0, "  ");
-              if (data.length() > 78) {
-                data = data.substr(0, 75) + "...";
-              }
-              cerr << "`" << data << "`" << endl;
-              exit(EXIT_FAILURE);
-            }
-          }
+        auto r = e->as<Rec>();
+        vector<Ref<Poly>> schemes;
+        infer_bindings(e, schemes);
+        for (size_t i = 0; i < schemes.size(); i++) {
+          context.set__env(r->slot + i, schemes[i]);
         }
-        for (auto &xe : e->xes) {
-          context.unset__env(xe.first);
+        ty = infer(r->e, sig);
+        for (size_t i = 0; i < schemes.size(); i++) {
+          context.unset__env(r->slot + i);
         }
-        for (auto &xe : e->xes) {
-          auto t = xe.second->sig != nullptr ? inst(xe.second->sig)
-                                             : find(tys[xe.first]);
-          if (xe.second->T != ExprType::ABS) {
-            cerr << "type error: rec of this type is not supported" << endl;
+        break;
+      }
+      case ExprType::CASE: {
+        // Each branch is checked once, in the scope of the equalities its
+        // constructor adds. Without a signature on the case, every branch
+        // meets the same types dom and res for the scrutinee and the result.
+        // With one, a branch unifies an instance of it with the return type
+        // of its constructor, and what is left unrefined becomes rigid: every
+        // variable is bound to a skolem, i.e. an existential variable, which
+        // unify never binds. A skolem whose level has dropped to that of the
+        // case once its branch is done has escaped.
+        auto ca = e->as<Case>();
+        auto gadt = ca->gadt;
+        if (gadt != nullptr) {
+          check(gadt);
+          auto t = find(get_mono(gadt));
+          if (!(is_fun(t) && is_c(find(t->tau[0])) && !is_p(find(t->tau[0])) &&
+                is_cd(find(t->tau[0])) &&
+                unit->data.count(name_of(find(t->tau[0])->D.D)))) {
+            err << "type error: invaliad signature for case expression" << endl
+                << to_string(gadt) << endl;
             string data = to_string(e, 0, "  ");
             if (data.length() > 78) {
               data = data.substr(0, 75) + "...";
             }
-            cerr << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
-          }
-          //          cerr << xe.first << " : "
-          //               << (xe.second->sig != nullptr ?
-          //               to_string(xe.second->sig)
-          //                                             :
-          //                                             to_string(tys[xe.first]))
-          //               << endl;
-        }
-        for (auto &xe : e->xes) {
-          if (xe.second->sig != nullptr) {
-            context.set__env(xe.first, xe.second->sig);
-          } else {
-            context.set__env(xe.first, gen(tys[xe.first]));
+            err << "`" << data << "`" << endl;
+            fail();
           }
         }
-        ty_ = infer(e->e, sig);
-        for (auto &xe : e->xes) {
-          context.unset__env(xe.first);
+        Ref<Mono> dom, res;
+        enter_level();
+        if (gadt == nullptr) {
+          dom = new_forall_var(new_const_kind());
+          res = new_forall_var(new_const_kind());
         }
-        ty = ty_;
-        break;
-      }
-      case ExprType::CASE: {
-        map<string, shared_ptr<Mono>> tys;
-        shared_ptr<Mono> ty_;
-        map<string, shared_ptr<Poly>> fns;
-        for (auto &pes_ : e->pes) {
-          auto pes = pes_.second;
-          assert(unit->cons.count(pes_.first));
-          auto c = unit->cons[pes_.first];
-          assert(c->arg == pes.first.size());
-          set<shared_ptr<Mono>> exists_var;
+        for (auto &pes : ca->pes) {
+          assert(unit->cons.count(pes.c));
+          auto c = unit->cons[pes.c];
+          assert(c->arg == pes.xs.size());
+          set<Ref<Mono>> skolems;
+          enter_level();
           auto tau =
-              inst_with_exists(c->sig, context.get_exists(c->name), exists_var);
-          vector<shared_ptr<Mono>> taus;
+              inst_with_exists(c->sig, context.get_exists(c->name), skolems);
+          vector<Ref<Mono>> taus;
           auto t = tau;
           while (is_fun(t)) {
             taus.push_back(t->tau[0]);
             t = t->tau[1];
           }
-          auto fn = new_fun();
-          fn->tau.push_back(t);
+          Ref<Mono> ret;
+          if (gadt == nullptr) {
+            ret = res;
+            if (!unify(dom, t, &err)) {
+              string data = to_string(e, 0, "  ");
+              if (data.length() > 78) {
+                data = data.substr(0, 75) + "...";
+              }
+              err << "`" << data << "`" << endl;
+              fail();
+            }
+          } else {
+            ret = new_forall_var(new_const_kind());
+            auto fn = new_fun();
+            fn->tau.push_back(t);
+            fn->tau.push_back(ret);
+            if (!unify(inst(gadt), fn, &err)) {
+              string data = to_string(e, 0, "  ");
+              if (data.length() > 78) {
+                data = data.substr(0, 75) + "...";
+              }
+              err << "`" << data << "`" << endl;
+              fail();
+            }
+            set<Ref<Mono>> fp;
+            ftv(fp, fn);
+            for (auto f : fp) {
+              if (is_f(f)) {
+                auto s = new_exists_var(f->kind);
+                bind(f, s);
+                skolems.insert(s);
+              }
+            }
+          }
           for (size_t i = 0; i < c->arg; i++) {
             if (!is_p(taus[i])) {
-              context.set__env(pes.first[i], new_poly(taus[i]));
+              context.set__env(pes.slot + i, new_poly(taus[i]));
             } else {
-              context.set__env(pes.first[i], taus[i]->sigma);
+              context.set__env(pes.slot + i, taus[i]->sigma);
             }
           }
-          auto ty_ = infer(pes.second, nullptr);
+          auto ty_ = infer(pes.e, nullptr);
           for (size_t i = 0; i < c->arg; i++) {
-            context.unset__env(pes.first[i]);
+            context.unset__env(pes.slot + i);
           }
-          fn->tau.push_back(ty_);
-          fns[pes_.first] = gen(fn, &exists_var);
-        }
-        auto gadt = e->gadt;
-        if (gadt != nullptr) {
-          check(gadt);
-          auto t = find(get_mono(gadt));
-          if (!(is_fun(t) && is_c(find(t->tau[0])) && !is_p(find(t->tau[0])) &&
-                is_cd(find(t->tau[0])) &&
-                unit->data.count(find(t->tau[0])->D.D))) {
-            cerr << "type error: invaliad signature for case expression" << endl
-                 << to_string(gadt) << endl;
+          if (!unify(ret, ty_, &err)) {
             string data = to_string(e, 0, "  ");
             if (data.length() > 78) {
               data = data.substr(0, 75) + "...";
             }
-            cerr << "`" << data << "`" << endl;
-            exit(EXIT_FAILURE);
+            err << "`" << data << "`" << endl;
+            fail();
           }
-        } else {
-          auto gadt_ = new_forall_var(new_const_kind());
-          for (auto &fn : fns) {
-            if (!unify(gadt_, inst(fn.second), &cerr)) {
+          leave_level();
+          for (auto s : skolems) {
+            if (s->level <= current_level) {
+              err << "type error: an existential type should not escape its "
+                     "scope"
+                  << endl;
+              err << to_string(s) << " in " << to_string(ty_) << endl;
               string data = to_string(e, 0, "  ");
               if (data.length() > 78) {
                 data = data.substr(0, 75) + "...";
               }
-              cerr << "`" << data << "`" << endl;
-              exit(EXIT_FAILURE);
+              err << "`" << data << "`" << endl;
+              fail();
             }
           }
-          gadt = gen(gadt_);
-          auto t = find(get_mono(gadt));
-          assert(is_fun(t) && is_c(find(t->tau[0])) && !is_p(find(t->tau[0])) &&
-                 is_cd(find(t->tau[0])) &&
-                 unit->data.count(find(t->tau[0])->D.D));
         }
-        //        for (auto &fn : fns) {
-        //          cerr << "case " << fn.first << " : " <<
-        //          to_string(fn.second)
-        //          << endl;
-        //        }
-        //        cerr << "gadt : " << to_string(gadt) << endl;
-        for (auto c : unit->data[unit->cons[fns.begin()->first]->data_name]
-                          ->constructors) {
-          set<shared_ptr<Mono>> exists_var;
-          auto tau =
-              inst_with_exists(c->sig, context.get_exists(c->name), exists_var);
-          auto t = tau;
+        leave_level();
+        // A constructor without a branch must not match the scrutinee. Only
+        // this check, which passes for a GADT alone, needs the case
+        // generalized when it has no signature.
+        auto da = unit->data[unit->cons[ca->pes.front().c]->data_name];
+        for (auto c : da->constructors) {
+          if (ca->find(StringView(c->name.data(), c->name.size()))) {
+            continue;
+          }
+          if (gadt == nullptr) {
+            auto fn = new_fun();
+            fn->tau.push_back(dom);
+            fn->tau.push_back(res);
+            gadt = gen(fn);
+          }
+          enter_level();
+          auto t = inst(c->sig);
           while (is_fun(t)) {
             t = t->tau[1];
           }
-          auto fn = new_fun(), ret = new_forall_var(new_const_kind());
+          auto fn = new_fun();
           fn->tau.push_back(t);
-          fn->tau.push_back(ret);
-          if (unify(inst(gadt), fn, nullptr)) {
-            if (fns.count(c->name)) {
-              set<shared_ptr<Mono>> st;
-              if (!unify(inst_get_set(gen(fn), st), inst(fns[c->name]), &cerr,
-                         &st)) {
-                string data = to_string(e, 0, "  ");
-                if (data.length() > 78) {
-                  data = data.substr(0, 75) + "...";
-                }
-                cerr << "`" << data << "`" << endl;
-                exit(EXIT_FAILURE);
-              }
-            } else {
-              cerr << "type error: non-exhaustive patterns `" << c->name << "`"
-                   << endl;
-              string data = to_string(e, 0, "  ");
-              if (data.length() > 78) {
-                data = data.substr(0, 75) + "...";
-              }
-              cerr << "`" << data << "`" << endl;
-              exit(EXIT_FAILURE);
-            }
-          } else {
-            if (fns.count(c->name)) {
-              unify(inst(gadt), fn, &cerr);
-              string data = to_string(e, 0, "  ");
-              if (data.length() > 78) {
-                data = data.substr(0, 75) + "...";
-              }
-              cerr << "`" << data << "`" << endl;
-              exit(EXIT_FAILURE);
+          fn->tau.push_back(new_forall_var(new_const_kind()));
+          bool matched = unify(inst(gadt), fn, nullptr);
+          leave_level();
+          if (matched) {
+            err << "type error: non-exhaustive patterns `" << c->name << "`"
+                << endl;
+            string data = to_string(e, 0, "  ");
+            if (data.length() > 78) {
+              data = data.substr(0, 75) + "...";
             }
+            err << "`" << data << "`" << endl;
+            fail();
           }
         }
-        ty_ = infer(e->e, nullptr);
-        ty = new_forall_var(new_const_kind());
-        auto fn = new_fun();
-        fn->tau.push_back(ty_);
-        fn->tau.push_back(ty);
-        if (!unify(fn, inst(gadt), &cerr)) {
-          string data = to_string(e, 0, "  ");
-          if (data.length() > 78) {
-            data = data.substr(0, 75) + "...";
+        auto ty_ = infer(ca->e, nullptr);
+        if (ca->gadt == nullptr) {
+          ty = res;
+          if (!unify(dom, ty_, &err)) {
+            string data = to_string(e, 0, "  ");
+            if (data.length() > 78) {
+              data = data.substr(0, 75) + "...";
+            }
+            err << "`" << data << "`" << endl;
+            fail();
+          }
+        } else {
+          ty = new_forall_var(new_const_kind());
+          auto fn = new_fun();
+          fn->tau.push_back(ty_);
+          fn->tau.push_back(ty);
+          if (!unify(fn, inst(gadt), &err)) {
+            string data = to_string(e, 0, "  ");
+            if (data.length() > 78) {
+              data = data.substr(0, 75) + "...";
+            }
+            err << "`" << data << "`" << endl;
+            fail();
           }
-          cerr << "`" << data << "`" << endl;
-          exit(EXIT_FAILURE);
         }
         break;
       }
       case ExprType::FFI: {
-        size_t idx = 0;
-        while (idx < e->ffi->source.length() &&
-               (idx = e->ffi->source.find("$", idx)) != string::npos) {
-          if (++idx < e->ffi->source.length()) {
-            char c = e->ffi->source[idx];
-            if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_') {
-              string v;
-              v.push_back(c);
-              idx++;
-              while (idx < e->ffi->source.length()) {
-                c = e->ffi->source[idx];
-                if (!(('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
-                      ('a' <= c && c <= 'z') || c == '_' || c == '\'')) {
-                  break;
-                }
-                v.push_back(c);
-                idx++;
-              }
-              if (!context.has__env(v)) {
-                cerr << "type error: " << v << " is not in context" << endl;
-                string data = to_string(e, 0, "  ");
-                if (data.length() > 78) {
-                  data = data.substr(0, 75) + "...";
-                }
-                cerr << "`" << data << "`" << endl;
-                exit(EXIT_FAILURE);
-              }
-            } else {
-              assert(false);
+        auto f = e->as<Ffi>();
+        for (size_t i = 0; i < f->vars.size(); i++) {
+          if (!context.has__env(f->slots[i])) {
+            err << "type error: " << f->vars[i] << " is not in context"
+                << endl;
+            string data = to_string(e, 0, "  ");
+            if (data.length() > 78) {
+              data = data.substr(0, 75) + "...";
             }
-          } else {
-            assert(false);
+            err << "`" << data << "`" << endl;
+            fail();
           }
         }
         ty = new_forall_var(new_const_kind());
@@ -1102,18 +1324,327 @@ struct TypeInfer {
       }
     }
     if (sig != nullptr) {
-      set<shared_ptr<Mono>> st;
-      if (!unify(inst_get_set(sig, st), ty, &cerr, &st)) {
+      set<Ref<Mono>> st;
+      if (!unify(inst_get_set(sig, st), ty, &err, &st)) {
         string data = to_string(e, 0, "  ");
         if (data.length() > 78) {
           data = data.substr(0, 75) + "...";
         }
-        cerr << "`" << data << "`" << endl;
-        exit(EXIT_FAILURE);
+        err << "`" << data << "`" << endl;
+        fail();
       }
     }
     return ty;
   }
+
+  // Collects the slots that the variables in e refer to.
+  void used_slots(Expr *e, set<uint32_t> &used) {
+    switch (e->T) {
+      case ExprType::VAR:
+        used.insert(e->as<Var>()->slot);
+        break;
+      case ExprType::APP:
+        used_slots(e->as<App>()->e1, used);
+        used_slots(e->as<App>()->e2, used);
+        break;
+      case ExprType::ABS:
+        used_slots(e->as<Abs>()->e, used);
+        break;
+      case ExprType::LET:
+        used_slots(e->as<Let>()->e1, used);
+        used_slots(e->as<Let>()->e2, used);
+        break;
+      case ExprType::REC:
+        for (auto &xe : e->as<Rec>()->xes) {
+          used_slots(xe.e, used);
+        }
+        used_slots(e->as<Rec>()->e, used);
+        break;
+      case ExprType::CASE:
+        used_slots(e->as<Case>()->e, used);
+        for (auto &pes : e->as<Case>()->pes) {
+          used_slots(pes.e, used);
+        }
+        break;
+      case ExprType::FFI:
+        used.insert(e->as<Ffi>()->slots.begin(), e->as<Ffi>()->slots.end());
+        break;
+    }
+  }
+
+  // A top-level `let` or `rec` whose bindings only need the schemes of the
+  // groups that define the names they use.
+  struct Group {
+    Expr *e;
+    vector<uint32_t> slots;
+    set<size_t> uses;
+    vector<size_t> users;
+    size_t waiting;
+    bool done, failed, cached;
+    vector<Ref<Poly>> schemes;
+    string errors;
+    double seconds;
+  };
+  // The groups of the last infer_groups, kept for write_stats, and whether
+  // there was one: a sequential run infers the bindings as one expression.
+  vector<Group> timed;
+  bool grouped = false;
+  // The schemes of the names a module exports.
+  map<string, Ref<Poly>> exports;
+
+  // Infers group i. A worker hands a type error back in the group, and fails
+  // as well if the schemes cannot be frozen for use by other threads.
+  bool infer_group(vector<Group> &groups, size_t i, bool worker) {
+    auto &g = groups[i];
+    stringstream errors;
+    TypeInfer w(*this, worker ? errors : err, worker);
+    auto start = chrono::steady_clock::now();
+    try {
+      w.infer_bindings(g.e, g.schemes);
+      g.seconds = chrono::duration<double>(chrono::steady_clock::now() - start)
+                      .count();
+    } catch (Failure &) {
+      g.errors = errors.str();
+      g.failed = true;
+      return false;
+    }
+    g.done = true;
+    for (size_t j = 0; j < g.slots.size(); j++) {
+      context.set__env(g.slots[j], g.schemes[j]);
+    }
+    if (worker) {
+      for (auto s : g.schemes) {
+        if (!freeze(s)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Splits the chain of top-level bindings into groups and infers them, on a
+  // pool of threads if there is more than one. Groups found in the cache are
+  // not inferred at all, and the groups inferred are added to it.
+  void infer_groups(size_t threads, uint64_t key) {
+    vector<Group> groups;
+    vector<uint64_t> keys;
+    map<uint32_t, size_t> scope;
+    auto e = unit->expr;
+    while (e->sig == nullptr &&
+           (e->T == ExprType::LET || e->T == ExprType::REC)) {
+      Group g;
+      g.e = e;
+      g.done = g.failed = g.cached = false;
+      g.seconds = 0;
+      set<uint32_t> used;
+      if (e->T == ExprType::LET) {
+        g.slots.push_back(e->as<Let>()->slot);
+        used_slots(e->as<Let>()->e1, used);
+      } else {
+        auto r = e->as<Rec>();
+        for (size_t i = 0; i < r->xes.size(); i++) {
+          g.slots.push_back(r->slot + i);
+        }
+        for (auto &xe : r->xes) {
+          used_slots(xe.e, used);
+        }
+      }
+      for (auto slot : used) {
+        if (scope.count(slot)) {
+          g.uses.insert(scope[slot]);
+        }
+      }
+      if (cache != nullptr) {
+        key = cache->group_key(key, e);
+        keys.push_back(key);
+        if (cache->load(key, e, g.schemes)) {
+          g.done = g.cached = true;
+          for (size_t j = 0; j < g.slots.size(); j++) {
+            context.set__env(g.slots[j], g.schemes[j]);
+          }
+        }
+      }
+      for (auto slot : g.slots) {
+        scope[slot] = groups.size();
+      }
+      e = e->T == ExprType::LET ? e->as<Let>()->e2 : e->as<Rec>()->e;
+      groups.push_back(g);
+    }
+    for (size_t i = 0; i < groups.size(); i++) {
+      set<size_t> deps;
+      for (auto u : groups[i].uses) {
+        if (!groups[u].done) {
+          deps.insert(u);
+        }
+      }
+      groups[i].waiting = deps.size();
+      for (auto d : deps) {
+        groups[d].users.push_back(i);
+      }
+    }
+
+    if (threads > 1) {
+      infer_parallel(groups, threads);
+    }
+    for (size_t i = 0; i < groups.size(); i++) {
+      if (groups[i].failed) {
+        err << groups[i].errors;
+        fail();
+      } else if (!groups[i].done) {
+        infer_group(groups, i, false);
+      }
+      if (cache != nullptr) {
+        if (groups[i].cached) {
+          cache->flush();
+        } else {
+          cache->save(keys[i], groups[i].e, groups[i].schemes);
+        }
+      }
+    }
+    if (cache != nullptr) {
+      cache->flush();
+    }
+    infer(e, nullptr);
+    for (auto &g : groups) {
+      for (auto slot : g.slots) {
+        context.unset__env(slot);
+      }
+      // a name bound again later is exported with its last scheme
+      auto xs = TypeCache::names(g.e);
+      for (size_t i = 0; i < xs.size(); i++) {
+        if (unit->exports.count(xs[i])) {
+          exports[xs[i]] = g.schemes[i];
+        }
+      }
+    }
+    if (stats_enabled) {
+      timed = groups;
+      grouped = true;
+    }
+  }
+
+  // Writes the counts in total_stats and the time each top-level binding
+  // group took as JSON, for tracking where inference spends its time. The
+  // counts are those of the inference that ran; only a grouped one, with
+  // threads, a cache or for a module, times each group.
+  void write_stats(ostream &out, double seconds) {
+    auto s = total_stats();
+    out << "{" << endl
+        << "  \"seconds\": " << seconds << "," << endl
+        << "  \"unify\": " << s.unify << "," << endl
+        << "  \"inst\": " << s.inst << "," << endl
+        << "  \"gen\": " << s.gen << "," << endl
+        << "  \"ftv\": " << s.ftv << "," << endl
+        << "  \"occ\": " << s.occ << "," << endl
+        << "  \"nodes\": " << s.nodes << "," << endl
+        << "  \"max_chain\": " << s.max_chain << "," << endl
+        << "  \"grouped\": " << (grouped ? "true" : "false") << "," << endl
+        << "  \"bindings\": [";
+    for (size_t i = 0; i < timed.size(); i++) {
+      auto &g = timed[i];
+      out << (i ? "," : "") << endl << "    {\"names\": [";
+      Position pos;
+      if (g.e->T == ExprType::LET) {
+        out << json_string(g.e->as<Let>()->x);
+        pos = g.e->as<Let>()->pos;
+      } else {
+        bool first = true;
+        for (auto &xe : g.e->as<Rec>()->xes) {
+          out << (first ? "" : ", ") << json_string(xe.x);
+          first = false;
+        }
+        pos = g.e->as<Rec>()->pos;
+      }
+      out << "], \"file\": " << json_string(filename_of(pos))
+          << ", \"line\": " << line_of(pos)
+          << ", \"column\": " << column_of(pos)
+          << ", \"cached\": " << (g.cached ? "true" : "false")
+          << ", \"seconds\": " << g.seconds << "}";
+    }
+    if (!timed.empty()) {
+      out << endl << "  ";
+    }
+    out << "]" << endl << "}" << endl;
+  }
+
+  // Infers each group on a pool of threads as soon as the groups it uses are
+  // done. Whatever is left when a group fails, or when a type cannot be shared
+  // between threads, is inferred afterwards in source order, so that the error
+  // reported is the one sequential inference would report.
+  void infer_parallel(vector<Group> &groups, size_t threads) {
+    bool stop = false;
+    for (auto &k : context.kind) {
+      stop = !freeze(k.second) || stop;
+    }
+    for (auto dai : unit->data) {
+      for (auto &c : dai.second->constructors) {
+        stop = !freeze(c->sig) || stop;
+      }
+    }
+    for (auto &g : groups) {
+      for (auto s : g.schemes) {
+        stop = !freeze(s) || stop;
+      }
+    }
+    // The ground types the parser shared between signatures get their kinds
+    // here, before any thread checks a signature that holds them.
+    for (auto &g : grounds) {
+      if (stop) {
+        break;
+      }
+      stringstream errors;
+      TypeInfer w(*this, errors, true);
+      try {
+        w.check(new_poly(g.second));
+      } catch (Failure &) {
+        stop = true;
+      }
+      stop = !freeze(g.second->kind) || stop;
+    }
+    mutex lock;
+    condition_variable cv;
+    deque<size_t> ready;
+    size_t running = 0;
+    for (size_t i = 0; i < groups.size(); i++) {
+      if (!groups[i].done && groups[i].waiting == 0) {
+        ready.push_back(i);
+      }
+    }
+    auto work = [&]() {
+      unique_lock<mutex> guard(lock);
+      for (;;) {
+        cv.wait(guard,
+                [&]() { return stop || !ready.empty() || running == 0; });
+        if (stop || ready.empty()) {
+          break;
+        }
+        auto i = ready.front();
+        ready.pop_front();
+        running++;
+        guard.unlock();
+        bool ok = infer_group(groups, i, true);
+        guard.lock();
+        running--;
+        if (ok) {
+          for (auto u : groups[i].users) {
+            if (--groups[u].waiting == 0) {
+              ready.push_back(u);
+            }
+          }
+        } else {
+          stop = true;
+        }
+        cv.notify_all();
+      }
+    };
+    vector<thread> pool;
+    for (size_t i = 0; i < threads; i++) {
+      pool.push_back(thread(work));
+    }
+    for (auto &t : pool) {
+      t.join();
+    }
+  }
 };
 
 #endif